@@ -42,6 +42,10 @@ class Camera
 	int imageWidth() const { return sizeinfo_[size_].width; }
 	int imageHeight() const { return sizeinfo_[size_].height; }
 
+	// bytes from each luma sample of a frame to the next; rows are
+	// imageWidth() samples apart
+	virtual int pixelStride() const { return 1; }
+
 	int getRate() const { return rate_; }
 
 	virtual const unsigned char *getFrame() = 0;
@@ -230,42 +230,17 @@ void V4L2Camera::stop()
 	}
 }
 
-static bool needsconv(unsigned long pixfmt)
+// YUYV frames are returned as they are, luma interleaved with
+// chroma; users read every other byte rather than having the frame
+// copied out into a luma plane.
+int V4L2Camera::pixelStride() const
 {
-	switch (pixfmt) {
-	default:
-	case V4L2_PIX_FMT_YUV420:
-		return false;
-
-	case V4L2_PIX_FMT_YUYV:
-		return true;
-	}
-}
-
-static void convert(unsigned long pixfmt, size_t inbytes,
-		    const unsigned char *in, unsigned char *out)
-{
-	switch (pixfmt) {
-	case V4L2_PIX_FMT_YUYV:
-		for (; inbytes > 4; inbytes -= 4) {
-			out[0] = in[0];
-			out[1] = in[2];
-
-			out += 2;
-			in += 4;
-		}
-		break;
-
-	default:
-		memcpy(out, in, inbytes);
-	}
+	return pixfmt_ == V4L2_PIX_FMT_YUYV ? 2 : 1;
 }
 
 const unsigned char *V4L2Camera::getFrame()
 {
-	const unsigned char *outbuf;
 	const unsigned char *inbuf;
-	unsigned char *tmpbuf = NULL;
 
 	if (!isOK()) {
 	failed:
@@ -299,25 +274,13 @@ const unsigned char *V4L2Camera::getFrame()
 		inbuf = frameptrs_[buffer.index];
 		mmap_prev_frame_ = buffer.index;
 	} else {
-		tmpbuf = new unsigned char[frame_size_];
-		read(fd_, tmpbuf, frame_size_);
-
-		inbuf = tmpbuf;
-	}
-
-	if (needsconv(pixfmt_)) {
 		if (retbuf_ == NULL)
 			retbuf_ = new unsigned char[frame_size_];
+		read(fd_, retbuf_, frame_size_);
 
-		outbuf = retbuf_;
-		convert(pixfmt_, frame_size_, inbuf, retbuf_);
-	} else {
-		outbuf = inbuf;
+		inbuf = retbuf_;
 	}
 
-	if (tmpbuf)
-		delete[] tmpbuf;
-
-	return outbuf;
+	return inbuf;
 }
 
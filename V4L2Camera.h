@@ -24,13 +24,14 @@ private:
 
 	unsigned long pixfmt_;	/* raw pixel format */
 
-	unsigned char *retbuf_;	/* buffer used to return if raw isn't useful */
+	unsigned char *retbuf_;	/* buffer frames are read into without mmap */
 
 public:
 	V4L2Camera(framesize_t size = SIF, int rate = 15);
 	~V4L2Camera();
 
 	int imageSize() const;
+	int pixelStride() const;
 	bool isOK() const;
 
 	bool start();
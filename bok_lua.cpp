@@ -54,6 +54,7 @@ void _glerr(const char *file, int line)
 
 static unsigned char *img;
 static unsigned img_w, img_h;
+static int img_stride = 1;	// bytes between pixels of img
 
 static bool ext_texture_rect;
 static int  max_texture_units;
@@ -98,14 +99,30 @@ bool get_xy(lua_State *L, int idx, float *x, float *y)
    Tracker interface
    ---------------------------------------------------------------------- */
 
+// Where KLT starts looking for each feature in a new frame
+enum predict {
+	PREDICT_NONE,		// where it was in the last frame
+	PREDICT_VELOCITY,	// where its last motion would take it
+	PREDICT_GLOBAL		// where the average motion would take it
+};
+
+// Features take part in the global average once they have been
+// tracked this many frames, as in constellation's FeatureSet
+static const int predict_adulthood = 10;
+
+static const char *predict_names[] = { "none", "velocity", "global", 0 };
+
 // userdata tracker structure
 struct tracker
 {
 	KLT_TrackingContextRec *tc;
-	KLT_FeatureListRec *fl;
+	KLT_FeatureStoreRec *fs;	// features, with their motion
+	KLT_FeatureStoreRec *pred;	// predicted positions
+	int *weight;			// each feature's val when selected
 
 	int min, max;
 	int active;
+	enum predict predict;
 };
 
 static int tracker_gc(lua_State *L);
@@ -118,33 +135,77 @@ static struct tracker *tracker_get(lua_State *L, int idx)
 	return tracker;
 }
 
-// Update feature set with tracking results
-// Args: tracker feature_set
-static int tracker_track(lua_State *L)
+static enum predict get_predict(lua_State *L, int idx)
 {
-	int narg = lua_gettop(L);
-	struct tracker *tc;
-	int active;
+	const char *str = lua_tostring(L, idx);
 
-	if (narg != 2 || !lua_isuserdata(L, 1) || !lua_istable(L, 2))
-		luaL_error(L, "args: tracker features");
+	for(int i = 0; str != NULL && predict_names[i] != NULL; i++)
+		if (strcmp(str, predict_names[i]) == 0)
+			return (enum predict)i;
 
-	if (img == NULL)
-		luaL_error(L, "image not read yet");
+	luaL_error(L, "predict must be \"none\", \"velocity\" or \"global\"");
+	return PREDICT_NONE;
+}
 
-	tc = tracker_get(L, 1);
+// Fill in tc->pred with where each feature is expected in the next
+// frame, from the motion KLT keeps for features it has tracked (age
+// > 0).  Features without a prediction get a negative val, which
+// tells KLT to start from their last position.  The global motion is
+// that of features older than predict_adulthood, weighted by their
+// strength when selected, the same rule as FeatureSet_Base::predict.
+static void tracker_predict(struct tracker *tc)
+{
+	const int nf = tc->fs->nFeatures;
+	const KLT_locType *x = tc->fs->x, *y = tc->fs->y;
+	const KLT_locType *vx = tc->fs->vx, *vy = tc->fs->vy;
+	const int *val = tc->fs->val, *age = tc->fs->age;
+	KLT_locType *px = tc->pred->x, *py = tc->pred->y;
+	int *pval = tc->pred->val;
+	float gx = 0, gy = 0;
+	int tot = 0;
+
+	for(int i = 0; i < nf; i++) {
+		pval[i] = -1;
+		if (val[i] < 0 || age[i] == 0)
+			continue;
 
-	if (tc->active == 0)
-		KLTSelectGoodFeatures(tc->tc, img, img_w, img_h, tc->fl);
-	if (tc->active < tc->min)
-		KLTReplaceLostFeatures(tc->tc, img, img_w, img_h, tc->fl);
-	else
-		KLTTrackFeatures(tc->tc, img, img, img_w, img_h, tc->fl);
+		px[i] = x[i] + vx[i];
+		py[i] = y[i] + vy[i];
+		pval[i] = 0;
+
+		if (age[i] > predict_adulthood) {
+			gx += vx[i] * tc->weight[i];
+			gy += vy[i] * tc->weight[i];
+			tot += tc->weight[i];
+		}
+	}
+
+	if (tc->predict == PREDICT_GLOBAL) {
+		if (tot != 0) {
+			gx /= tot;
+			gy /= tot;
+		}
+
+		for(int i = 0; i < nf; i++) {
+			px[i] = x[i] + gx;
+			py[i] = y[i] + gy;
+			pval[i] = val[i] >= 0 ? 0 : -1;
+		}
+	}
+}
+
+// Bring the feature set (arg 2) up to date with the feature store,
+// calling its lost and add methods for features that went or came
+static void tracker_sync(lua_State *L, struct tracker *tc)
+{
+	int active;
 
 	active = 0;
 
-	for(int i = 0; i < tc->fl->nFeatures; i++) {
-		KLT_Feature f = tc->fl->feature[i];
+	const KLT_locType *fx = tc->fs->x, *fy = tc->fs->y;
+	const int *fval = tc->fs->val;
+
+	for(int i = 0; i < tc->fs->nFeatures; i++) {
 		int lidx = i+1;	// lua idx - 1-based arrays
 
 		lua_pushnumber(L, lidx);
@@ -155,11 +216,11 @@ static int tracker_track(lua_State *L)
 		// compare the state of the point in the KLT features
 		// array with the state in the feature_set table, and
 		// update accordingly.
-		if ((f->val < 0) && lua_isnil(L, -1)) {
+		if ((fval[i] < 0) && lua_isnil(L, -1)) {
 			// stk: tracker features 
 
 			// nothing to do
-		} else if ((f->val < 0) && lua_istable(L, -1)) {
+		} else if ((fval[i] < 0) && lua_istable(L, -1)) {
 			// lost feature
 			static const char *reasons[] = {
 				"not_found",
@@ -168,7 +229,7 @@ static int tracker_track(lua_State *L)
 				"oob",
 				"large_residue"
 			};
-			int ridx = -f->val - 1;
+			int ridx = -fval[i] - 1;
 
 			// see if there's a lost method in top
 			lua_pushstring(L, "lost");
@@ -190,41 +251,43 @@ static int tracker_track(lua_State *L)
 			lua_settable(L, 2);
 			
 			// stk: tracker features
-		} else if ((f->val >= 0) && lua_isnil(L, -1)) {
+		} else if ((fval[i] >= 0) && lua_isnil(L, -1)) {
 			// new feature
+			tc->weight[i] = fval[i];
+
 			// look for "add" method in features
-			if (!call_lua(L, 0, 2, "add", "Iiffi", 2, lidx, f->x, f->y, f->val)) {
+			if (!call_lua(L, 0, 2, "add", "Iiffi", 2, lidx, fx[i], fy[i], fval[i])) {
 				lua_pushnumber(L, lidx);
 				lua_newtable(L);
 
 				lua_pushstring(L, "x");
-				lua_pushnumber(L, f->x);
+				lua_pushnumber(L, fx[i]);
 				lua_settable(L, -3);
 
 				lua_pushstring(L, "y");
-				lua_pushnumber(L, f->y);
+				lua_pushnumber(L, fy[i]);
 				lua_settable(L, -3);
 
 				lua_pushstring(L, "weight");
-				lua_pushnumber(L, f->val);
+				lua_pushnumber(L, fval[i]);
 				lua_settable(L, -3);
 
 				lua_settable(L, 2);
 			}
 
 			active++;
-		} else if ((f->val >= 0) && lua_istable(L, -1)) {
+		} else if ((fval[i] >= 0) && lua_istable(L, -1)) {
 			// update feature
 			
 			// look for "move" in point
-			if (!call_lua(L, 0, 3, "move", "Iff", -1, f->x, f->y)) {
+			if (!call_lua(L, 0, 3, "move", "Iff", -1, fx[i], fy[i])) {
 				// manual update
 				lua_pushstring(L, "x");
-				lua_pushnumber(L, f->x);
+				lua_pushnumber(L, fx[i]);
 				lua_settable(L, 3);
 
 				lua_pushstring(L, "y");
-				lua_pushnumber(L, f->y);
+				lua_pushnumber(L, fy[i]);
 				lua_settable(L, 3);
 			}
 			active++;
@@ -235,6 +298,50 @@ static int tracker_track(lua_State *L)
 	}
 
 	tc->active = active;
+}
+
+// Update feature set with tracking results
+// Args: tracker feature_set
+static int tracker_track(lua_State *L)
+{
+	int narg = lua_gettop(L);
+	struct tracker *tc;
+
+	if (narg != 2 || !lua_isuserdata(L, 1) || !lua_istable(L, 2))
+		luaL_error(L, "args: tracker features");
+
+	if (img == NULL)
+		luaL_error(L, "image not read yet");
+
+	tc = tracker_get(L, 1);
+
+	// KLT reads the frame where it is, interleaved or not
+	KLT_ImageRec frame;
+	frame.data = img;
+	frame.ncols = img_w;
+	frame.nrows = img_h;
+	frame.rowStride = img_w * img_stride;
+	frame.pixelStride = img_stride;
+
+	if (tc->active == 0) {
+		KLTSelectGoodFeatureStoreImage(tc->tc, &frame, tc->fs);
+		tracker_sync(L, tc);
+	} else {
+		if (tc->predict != PREDICT_NONE)
+			tracker_predict(tc);
+
+		KLTTrackFeatureStoreImage(tc->tc, &frame, &frame, tc->fs,
+					  tc->predict != PREDICT_NONE ? tc->pred : NULL);
+		tracker_sync(L, tc);
+
+		// Top up after tracking, as FeatureSet_Base::update does:
+		// with replace_bands, each call only searches part of the
+		// frame, so the rest must keep being tracked meanwhile
+		if (tc->active < tc->min) {
+			KLTReplaceLostFeatureStoreImage(tc->tc, &frame, tc->fs);
+			tracker_sync(L, tc);
+		}
+	}
 
 	return 0;
 }
@@ -259,20 +366,49 @@ static int tracker_index(lua_State *L)
 		lua_pushnumber(L, tc->min);
 	else if (strcmp(str, "max") == 0)
 		lua_pushnumber(L, tc->max);
+	else if (strcmp(str, "predict") == 0)
+		lua_pushstring(L, predict_names[tc->predict]);
+	else if (strcmp(str, "attempted") == 0)	// stats from the last track
+		lua_pushnumber(L, tc->tc->nTrackAttempted);
+	else if (strcmp(str, "lost") == 0)
+		lua_pushnumber(L, tc->tc->nTrackLost);
+	else if (strcmp(str, "iterations") == 0)
+		lua_pushnumber(L, tc->tc->nTrackIterations);
 	else
 		lua_pushnil(L);
 
 	return 1;
 }
 
+static int tracker_newindex(lua_State *L)
+{
+	struct tracker *tc;
+	const char *str;
+
+	tc = tracker_get(L, 1);
+
+	if (!lua_isstring(L, 2))
+		luaL_error(L, "tracker index must be string");
+
+	str = lua_tostring(L, 2);
+
+	if (strcmp(str, "predict") == 0)
+		tc->predict = get_predict(L, 3);
+	else
+		luaL_error(L, "can't set tracker.%s", str);
+
+	return 0;
+}
+
 // Creates a tracker userdata type
-// args (min, max, [ mindist ])
+// args (min, max, [ mindist, [ predict ] ])
 static int tracker_new(lua_State *L)
 {
 	struct tracker *tc;
 	int narg = lua_gettop(L);
 	int min, max;
 	int mindist = 15;
+	enum predict predict = PREDICT_NONE;
 
 	if (narg < 2 || !lua_isnumber(L, 1) || !lua_isnumber(L, 2))
 		luaL_error(L, "need min and max");
@@ -282,18 +418,25 @@ static int tracker_new(lua_State *L)
 
 	if (narg >= 3 && lua_isnumber(L, 3))
 		mindist = (int)lua_tonumber(L, 3);
+	if (narg >= 4)
+		predict = get_predict(L, 4);
 
 	tc = (struct tracker *)lua_newuserdata(L, sizeof(*tc));	// user
 	tc->tc = KLTCreateTrackingContext();
-	KLTSetVerbosity(0);
+	tc->tc->verbosity = 0;
 
 	tc->tc->sequentialMode = true;
 	tc->tc->mindist = mindist;
-	tc->fl = KLTCreateFeatureList(max);
+	// spread replacement over frames, a quarter of the image each
+	tc->tc->replace_bands = 4;
+	tc->fs = KLTCreateFeatureStore(max, true);
+	tc->pred = KLTCreateFeatureStore(max, false);
+	tc->weight = new int[max];
 
 	tc->min = min;
 	tc->max = max;
 	tc->active = 0;
+	tc->predict = predict;
 
 	luaL_getmetatable(L, "bokchoi.tracker");	// user meta
 	if (!lua_istable(L, -1))
@@ -310,7 +453,9 @@ static int tracker_gc(lua_State *L)
 
 	tc = tracker_get(L, 1);
 
-	KLTFreeFeatureList(tc->fl);
+	KLTFreeFeatureStore(tc->fs);
+	KLTFreeFeatureStore(tc->pred);
+	delete[] tc->weight;
 	KLTFreeTrackingContext(tc->tc);
 
 	return 0;
@@ -327,6 +472,7 @@ static const luaL_reg tracker_methods[] = {
 static const luaL_reg tracker_meta[] = {
 	{ "__gc",	tracker_gc },
 	{ "__index",	tracker_index },
+	{ "__newindex",	tracker_newindex },
 	{ 0,0 }
 };
 
@@ -480,11 +626,15 @@ void texture_init_texcoord(struct texture *tex, float w, float h)
 // extension if possible, to avoid having to allocate lots of texture
 // memory and handle the non-power-of-2 edge cases.
 //
+// srcfmt is the layout of img, which GL converts to fmt; luma
+// interleaved with chroma can be given as GL_LUMINANCE_ALPHA, and the
+// chroma is dropped.
+//
 // TODO: defer allocating texture memory until we first render?
 static int texture_new_frame(lua_State *L,
 			     const unsigned char *img, 
 			     int width, int height,
-			     GLenum fmt)
+			     GLenum fmt, GLenum srcfmt)
 {
 	struct texture *tex;
 
@@ -523,7 +673,7 @@ static int texture_new_frame(lua_State *L,
 
 	glTexImage2D(tex->target, 0, fmt, 
 		     tex->texwidth, tex->texheight, 0,
-		     fmt, GL_UNSIGNED_BYTE, img);
+		     srcfmt, GL_UNSIGNED_BYTE, img);
 	
 	glTexParameteri(tex->target, GL_TEXTURE_WRAP_S,
 			GL_CLAMP_TO_EDGE);
@@ -1276,15 +1426,17 @@ void lua_cleanup()
 	lua_close(state);
 }
 
-void lua_frame(const unsigned char *img, int img_w, int img_h)
+void lua_frame(const unsigned char *img, int img_w, int img_h, int pixstride)
 {
 	// call process_frame, if any
 	::img = (unsigned char *)img;
 	::img_w = img_w;
 	::img_h = img_h;
+	::img_stride = pixstride;
 
 	GLERR();
-	texture_new_frame(state, img, img_w, img_h, GL_LUMINANCE);
+	texture_new_frame(state, img, img_w, img_h, GL_LUMINANCE,
+			  pixstride == 2 ? GL_LUMINANCE_ALPHA : GL_LUMINANCE);
 	//printf(">>> %d\n", lua_gettop(state));
 	call_lua(state, 0, LUA_GLOBALSINDEX, "process_frame", "I", -1);
 	lua_pop(state, 1);	// pop frame
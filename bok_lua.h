@@ -21,7 +21,8 @@ struct texture {
 
 
 void lua_setup(const char *src);
-void lua_frame(const unsigned char *img, int width, int height);
+void lua_frame(const unsigned char *img, int width, int height,
+	       int pixstride = 1);
 void lua_cleanup();
 
 struct lua_State;
@@ -311,6 +311,7 @@ static void display(void)
 {
 	static const unsigned char *img;
 	static unsigned int img_w, img_h;
+	static int img_stride;
 
 	GLERR();
 
@@ -318,6 +319,7 @@ static void display(void)
 		img = cam->getFrame();
 		img_w = cam->imageWidth();
 		img_h = cam->imageHeight();
+		img_stride = cam->pixelStride();
 	}
 
 	glClearColor(.2, .2, .2, 1);
@@ -325,7 +327,7 @@ static void display(void)
 	
 	GLERR();
 
-	lua_frame(img, img_w, img_h);
+	lua_frame(img, img_w, img_h, img_stride);
 
 	GLERR();
 
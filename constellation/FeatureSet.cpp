@@ -8,20 +8,27 @@ extern "C" {
 }
 
 FeatureSet_Base::FeatureSet_Base(int maxFeatures, int minFeatures)
+	: klt_fs_(NULL), klt_pred_(NULL), maxFeatures_(0),
+	  prediction_(PredictNone)
 {
 	klt_tc_ = KLTCreateTrackingContext();
-	KLTSetVerbosity(0);
+	klt_tc_->verbosity = 0;
 
 	klt_tc_->sequentialMode = true;
 	//klt_tc_->mindist = 25;
 	klt_tc_->mindist = 15;
+	// spread replacement over frames, a quarter of the image each
+	klt_tc_->replace_bands = 4;
+	// stars are sharp points; Harris on Sobel finds them cheaply
+	klt_tc_->detector = KLT_DETECT_HARRIS;
 	
 	setNumFeatures(minFeatures, maxFeatures);
 }
 
 FeatureSet_Base::~FeatureSet_Base()
 {
-	KLTFreeFeatureList(klt_fl_);
+	KLTFreeFeatureStore(klt_fs_);
+	KLTFreeFeatureStore(klt_pred_);
 	KLTFreeTrackingContext(klt_tc_);
 }
 
@@ -34,9 +41,13 @@ void FeatureSet_Base::setNumFeatures(int min, int max)
 		if (features_[i] != NULL)
 			removeFeature(features_[i]);
 
-	if (klt_fl_ != NULL)
-		KLTFreeFeatureList(klt_fl_);
-	klt_fl_ = KLTCreateFeatureList(max);
+	if (klt_fs_ != NULL)
+		KLTFreeFeatureStore(klt_fs_);
+	klt_fs_ = KLTCreateFeatureStore(max, true);
+
+	if (klt_pred_ != NULL)
+		KLTFreeFeatureStore(klt_pred_);
+	klt_pred_ = KLTCreateFeatureStore(max, false);
 
 	minFeatures_ = min;
 	maxFeatures_ = max;
@@ -48,33 +59,85 @@ void FeatureSet_Base::setNumFeatures(int min, int max)
 
 void FeatureSet_Base::sync()
 {
-	// Sync KLT feature state with our feature state
-	for(int i = 0; i < klt_fl_->nFeatures; i++) {
-		KLT_Feature f = klt_fl_->feature[i];
+	const KLT_locType *x = klt_fs_->x, *y = klt_fs_->y;
+	const int *val = klt_fs_->val;
 
+	// Sync KLT feature state with our feature state
+	for(int i = 0; i < klt_fs_->nFeatures; i++) {
 		if (0)
-			printf("f=%p f->val=%d (%g,%g) features_[%d]=%p\n",
-			       f, f->val, f->x, f->y, i, features_[i]);
+			printf("val=%d (%g,%g) features_[%d]=%p\n",
+			       val[i], x[i], y[i], i, features_[i]);
 
-		if ((f->val < 0) && (features_[i] == NULL)) {
+		if ((val[i] < 0) && (features_[i] == NULL)) {
 			// do nothing
-		} else if ((f->val < 0) && (features_[i] != NULL)) {
+		} else if ((val[i] < 0) && (features_[i] != NULL)) {
 			removeFeature(features_[i]);
 			features_[i] = NULL;
-			VALGRIND_MAKE_WRITABLE(&f->x, sizeof(f->x));
-			VALGRIND_MAKE_WRITABLE(&f->y, sizeof(f->y));
+			VALGRIND_MAKE_WRITABLE(&x[i], sizeof(x[i]));
+			VALGRIND_MAKE_WRITABLE(&y[i], sizeof(y[i]));
 			active_--;
-		} else if ((f->val >= 0) && (features_[i] == NULL)) {
-			Feature *feature = newFeature(f->x, f->y, f->val);
+		} else if ((val[i] >= 0) && (features_[i] == NULL)) {
+			Feature *feature = newFeature(x[i], y[i], val[i]);
 			features_[i] = feature;
 			active_++;
-		} else if ((f->val >= 0) && (features_[i] != NULL)) {
-			features_[i]->update(f->x, f->y);
+		} else if ((val[i] >= 0) && (features_[i] != NULL)) {
+			features_[i]->update(x[i], y[i]);
 		} else
 			abort();
 	}
 }
 
+// Fill in klt_pred_ with where each feature is expected in the next
+// frame, from the motion KLT keeps alongside each feature.  Features
+// without a prediction get a negative val, which tells KLT to start
+// from their last position.
+void FeatureSet_Base::predict()
+{
+	const int n = klt_fs_->nFeatures;
+	const KLT_locType *x = klt_fs_->x, *y = klt_fs_->y;
+	const KLT_locType *vx = klt_fs_->vx, *vy = klt_fs_->vy;
+	const int *val = klt_fs_->val, *age = klt_fs_->age;
+	KLT_locType *px = klt_pred_->x, *py = klt_pred_->y;
+	int *pval = klt_pred_->val;
+	float gx = 0, gy = 0;
+
+	if (prediction_ == PredictNone) {
+		for(int i = 0; i < n; i++)
+			pval[i] = -1;
+		return;
+	}
+
+	if (prediction_ == PredictGlobal) {
+		int tot = 0;
+
+		// Weighted by each feature's strength when it was selected
+		for(int i = 0; i < n; i++)
+			if (val[i] >= 0 && age[i] > Feature::Adulthood) {
+				int w = features_[i]->val();
+
+				gx += vx[i] * w;
+				gy += vy[i] * w;
+				tot += w;
+			}
+
+		if (tot != 0) {
+			gx /= tot;
+			gy /= tot;
+		}
+	}
+
+	for(int i = 0; i < n; i++) {
+		if (prediction_ == PredictVelocity) {
+			px[i] = x[i] + vx[i];
+			py[i] = y[i] + vy[i];
+		} else {
+			px[i] = x[i] + gx;
+			py[i] = y[i] + gy;
+		}
+		pval[i] = val[i];
+	}
+}
+
 void FeatureSet_Base::update(const unsigned char *img, int w, int h)
 {
 	KLT_PixelType *pix = (KLT_PixelType *)img;
@@ -84,21 +147,23 @@ void FeatureSet_Base::update(const unsigned char *img, int w, int h)
 		       active_, minFeatures_, maxFeatures_);
 
 	if (active_ == 0) {
-		KLTSelectGoodFeatures(klt_tc_, pix, w, h, klt_fl_);
+		KLTSelectGoodFeatureStore(klt_tc_, pix, w, h, klt_fs_);
 		sync();
 	} else {
-		KLTTrackFeatures(klt_tc_, pix, pix, w, h, klt_fl_);
+		predict();
+		KLTTrackFeatureStore(klt_tc_, pix, pix, w, h, klt_fs_,
+				     klt_pred_);
 		sync();
 
 		if (active_ < minFeatures_) {
-			KLTReplaceLostFeatures(klt_tc_, pix, w, h, klt_fl_);
+			KLTReplaceLostFeatureStore(klt_tc_, pix, w, h, klt_fs_);
 			sync();
 		}
 	}
 
 
 
-	assert(active_ == KLTCountRemainingFeatures(klt_fl_));
+	assert(active_ == KLTCountRemainingFeatureStore(klt_fs_));
 }
 
 template class FeatureSet<Feature>;
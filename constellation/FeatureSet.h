@@ -16,14 +16,26 @@ class FeatureSet_Base
 public:
 	typedef std::vector<Feature *> FeatureVec_t;
 
+	// Where KLT starts looking for each feature in a new frame
+	typedef enum prediction {
+		PredictNone,		// where it was in the last frame
+		PredictVelocity,	// where its last motion would take it
+		PredictGlobal		// where the mature features' average
+					// motion would take it
+	} prediction_t;
+
 private:
 	KLT_TrackingContextRec *klt_tc_;
-	KLT_FeatureListRec *klt_fl_;
+	KLT_FeatureStoreRec *klt_fs_;	// features, with their motion
+	KLT_FeatureStoreRec *klt_pred_;	// predicted positions
 
 	int maxFeatures_, minFeatures_;
 	int active_;
 
+	prediction_t prediction_;
+
 	void sync();
+	void predict();
 
 protected:
 	FeatureVec_t	features_;
@@ -52,6 +64,14 @@ public:
 	int windowHeight() const { return klt_tc_->window_height; }
 
 	int nFeatures() const { return active_; }
+
+	void setPrediction(prediction_t p) { prediction_ = p; }
+	prediction_t prediction() const { return prediction_; }
+
+	// Statistics from the last frame tracked
+	int trackAttempted() const { return klt_tc_->nTrackAttempted; }
+	int trackLost() const { return klt_tc_->nTrackLost; }
+	int trackIterations() const { return klt_tc_->nTrackIterations; }
 };
 
 template <class FT_ = Feature>
@@ -52,6 +52,7 @@ static bool warp = false;
 static bool paused = false;
 static bool capture = false;
 static bool autoconst = true;
+static bool trackstats = false;
 static gzFile recordfile = NULL;
 static bool fullscreen = false;
 static bool overlay = true;
@@ -916,6 +917,12 @@ static void display(void)
 		features.update(img, cam->imageWidth(), cam->imageHeight());
 		active = features.nFeatures();
 
+		if (trackstats && features.trackAttempted() != 0)
+			printf("tracked %d: lost %d (%.1f%%), %.1f iterations/feature\n",
+			       features.trackAttempted(), features.trackLost(),
+			       100. * features.trackLost() / features.trackAttempted(),
+			       (float)features.trackIterations() / features.trackAttempted());
+
 #if 0
 		if (antishake) {
 			for(int i = 0; i < nFeatures; i++) {
@@ -1260,6 +1267,20 @@ static void keyboard(SDL_keysym *sym)
 		features.zero();
 		break;
 
+	case SDLK_v:
+	{
+		static const char *names[] = { "none", "velocity", "global" };
+		int p = (features.prediction() + 1) % 3;
+
+		features.setPrediction((FeatureSet_Base::prediction_t)p);
+		printf("motion prediction: %s\n", names[p]);
+		break;
+	}
+
+	case SDLK_i:
+		trackstats = !trackstats;
+		break;
+
 	default:
 		break;
 	}
@@ -5,18 +5,23 @@
 /* Standard includes */
 #include <assert.h>
 #include <math.h>
-#include <stdlib.h>   /* malloc(), realloc() */
-#include <stdint.h>
+#include <pthread.h>
+#include <stdlib.h>   /* malloc(), realloc(), getenv() */
+#include <string.h>   /* strcmp(), memmove(), memset() */
 
 /* Our includes */
 #include "base.h"
 #include "error.h"
 #include "convolve.h"
 #include "klt_util.h"   /* printing */
+#include "threads.h"
 
-#if __SSE__
-#include <xmmintrin.h>
-#define USE_SSE
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define KLT_X86_SIMD
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
 #endif
 
 #define MAX_KERNEL_WIDTH 	71
@@ -27,26 +32,41 @@ typedef struct  {
   float data[MAX_KERNEL_WIDTH];
 }  ConvolutionKernel;
 
-/* Kernels */
-static ConvolutionKernel gauss_kernel;
-static ConvolutionKernel gaussderiv_kernel;
-static float sigma_last = -10.0;
+/* Kernel cache.  Each tracking context keeps the kernels for the few
+   sigmas it uses (smoothing, pyramid and gradient), so that alternating
+   between them does not rebuild the kernels every time. */
+#define KERNEL_CACHE_SIZE	8
+
+typedef struct  {
+  float sigma;
+  ConvolutionKernel gauss;
+  ConvolutionKernel gaussderiv;
+  short fixedgauss[MAX_KERNEL_WIDTH];	/* gauss, scaled by 2^KERNEL_SHIFT */
+}  _KernelPair;
+
+#define KERNEL_SHIFT	14
+
+typedef struct  {
+  int nused;
+  int next;			/* slot to reuse once the cache is full */
+  _KernelPair pair[KERNEL_CACHE_SIZE];
+}  _KLT_KernelCacheRec, *_KLT_KernelCache;
 
 
 /*********************************************************************
  * _KLTToFloatImage
  *
- * Given a pointer to image data (probably unsigned chars), copy
- * data to a float image.
+ * Copies 8-bit image data to a float image, reading only the pixels
+ * the descriptor points at.
  */
 
 void _KLTToFloatImage(
-  KLT_PixelType *img,
-  int ncols, int nrows,
+  KLT_Image img,
   _KLT_FloatImage floatimg)
 {
-  int size = ncols*nrows;
-  int i;
+  int ncols = img->ncols, nrows = img->nrows;
+  int step = img->pixelStride;
+  int i, j;
 
   /* Output image must be large enough to hold result */
   assert(floatimg->ncols >= ncols);
@@ -55,8 +75,16 @@ void _KLTToFloatImage(
   floatimg->ncols = ncols;
   floatimg->nrows = nrows;
 
-  for(i = 0; i < size; i++)
-    floatimg->data[i] = (float)img[i];
+  for (j = 0 ; j < nrows ; j++)  {
+    const KLT_PixelType *in = img->data + (size_t) j * img->rowStride;
+    float *out = floatimg->data + j*floatimg->stride;
+    if (step == 1)
+      for (i = 0 ; i < ncols ; i++)
+        out[i] = (float) in[i];
+    else
+      for (i = 0 ; i < ncols ; i++)
+        out[i] = (float) in[i*step];
+  }
 }
 
 
@@ -116,8 +144,87 @@ static void _computeKernels(
     for (i = -hw ; i <= hw ; i++)  den -= i*gaussderiv->data[i+hw];
     for (i = -hw ; i <= hw ; i++)  gaussderiv->data[i+hw] /= den;
   }
+}
+
+
+/*********************************************************************
+ * _quantizeKernel
+ *
+ * Converts a normalized smoothing kernel to fixed point, adjusting the
+ * centre tap so that the taps still sum to exactly one.
+ */
+
+static void _quantizeKernel(
+  ConvolutionKernel *kernel,
+  short *fixed)
+{
+  int sum = 0;
+  int i;
+
+  for (i = 0 ; i < kernel->width ; i++)  {
+    fixed[i] = (short) floorf(kernel->data[i] * (1 << KERNEL_SHIFT) + 0.5f);
+    sum += fixed[i];
+  }
+  fixed[kernel->width/2] += (1 << KERNEL_SHIFT) - sum;
+}
+
+
+/*********************************************************************
+ * _KLTCreateKernelCache
+ * _KLTFreeKernelCache
+ */
+
+void *_KLTCreateKernelCache(void)
+{
+  _KLT_KernelCache cache;
+
+  cache = (_KLT_KernelCache) malloc(sizeof(_KLT_KernelCacheRec));
+  if (cache == NULL)
+    KLTError("(_KLTCreateKernelCache) Out of memory");
+  cache->nused = 0;
+  cache->next = 0;
+
+  return cache;
+}
+
+void _KLTFreeKernelCache(
+  void *cache)
+{
+  free(cache);
+}
+
+
+/*********************************************************************
+ * _getKernels
+ *
+ * Returns the kernels for sigma from the context's cache, computing
+ * them only the first time sigma is seen.
+ */
+
+static _KernelPair *_getKernels(
+  KLT_TrackingContext tc,
+  float sigma)
+{
+  _KLT_KernelCache cache = (_KLT_KernelCache) tc->kernel_cache;
+  _KernelPair *pair;
+  int i;
+
+  for (i = 0 ; i < cache->nused ; i++)
+    if (cache->pair[i].sigma == sigma)
+      return &cache->pair[i];
+
+  if (cache->nused < KERNEL_CACHE_SIZE)  {
+    pair = &cache->pair[cache->nused++];
+  } else  {
+    pair = &cache->pair[cache->next];
+    cache->next = (cache->next + 1) % KERNEL_CACHE_SIZE;
+  }
+
+  _computeKernels(sigma, &pair->gauss, &pair->gaussderiv);
+  _quantizeKernel(&pair->gauss, pair->fixedgauss);
+  pair->sigma = sigma;
 
-  sigma_last = sigma;
+  return pair;
 }
 	
 
@@ -127,279 +234,1212 @@ static void _computeKernels(
  */
 
 void _KLTGetKernelWidths(
+  KLT_TrackingContext tc,
   float sigma,
   int *gauss_width,
   int *gaussderiv_width)
 {
-  _computeKernels(sigma, &gauss_kernel, &gaussderiv_kernel);
-  *gauss_width = gauss_kernel.width;
-  *gaussderiv_width = gaussderiv_kernel.width;
+  _KernelPair *kernels = _getKernels(tc, sigma);
+
+  *gauss_width = kernels->gauss.width;
+  *gaussderiv_width = kernels->gaussderiv.width;
 }
 
 
 /*********************************************************************
- * _convolveImageHoriz
+ * Row convolution primitives
+ *
+ * Each convolution pass is built from two primitives:  _convolveRow*
+ * convolves one row horizontally, writing zeros where the kernel
+ * would run off either end, and _convolveColumns* convolves a run of
+ * kernel.width rows (stride floats apart) vertically into one output
+ * row.  The scalar versions are the reference.  The SIMD versions
+ * compute several neighbouring outputs at once but accumulate each
+ * output in exactly the same order, so every version gives the same
+ * results, and any width is handled by finishing the tail with the
+ * scalar code.
  */
 
-static void _convolveImageHoriz(
-  _KLT_FloatImage imgin,
-  ConvolutionKernel kernel,
-  _KLT_FloatImage imgout)
+static void _convolveRowRange(
+  const float *in,
+  const float *kernel,
+  int width,
+  float *out,
+  int i0, int i1)        /* output columns, radius <= i0 <= i1 */
 {
-  int rowidx = 0;           /* Points to row's first pixel */
-  int outidx = 0;
-  int ppidx;
-  
-  register float sum;
-  register int radius = kernel.width / 2;
-  register int ncols = imgin->ncols, nrows = imgin->nrows;
-  register int i, j, k;
+  int radius = width / 2;
+  int i, k;
+
+  for (i = i0 ; i < i1 ; i++)  {
+    const float *ppp = in + i - radius;
+    float sum = 0.0;
+    for (k = width-1 ; k >= 0 ; k--)
+      sum += *ppp++ * kernel[k];
+    out[i] = sum;
+  }
+}
 
-  /* Kernel width must be odd */
-  assert(kernel.width % 2 == 1);
+static void _convolveRowBorders(
+  int ncols,
+  int width,
+  float *out)
+{
+  int radius = width / 2;
+  int i;
 
-  /* Must read from and write to different images */
-  assert(imgin != imgout);
+  /* Zero leftmost and rightmost columns */
+  for (i = 0 ; i < radius && i < ncols ; i++)
+    out[i] = 0.0;
+  for (i = max(ncols - radius, radius) ; i < ncols ; i++)
+    out[i] = 0.0;
+}
 
-  /* Output image must be large enough to hold result */
-  assert(imgout->ncols >= imgin->ncols);
-  assert(imgout->nrows >= imgin->nrows);
+static void _convolveRowScalar(
+  const float *in,
+  int ncols,
+  const float *kernel,
+  int width,
+  float *out)
+{
+  int radius = width / 2;
 
-  /* For each row, do ... */
-  for (j = 0 ; j < nrows ; j++)  {
+  _convolveRowBorders(ncols, width, out);
+  _convolveRowRange(in, kernel, width, out, radius, ncols - radius);
+}
 
-    /* Zero leftmost columns */
-    for (i = 0 ; i < radius ; i++)
-      imgout->data[outidx++] = 0.0;
-
-    /* Convolve middle columns with kernel */
-    for ( ; i < ncols - radius ; i++)  {
-      ppidx = rowidx + i - radius;
-      sum = 0.0;
-      for (k = kernel.width-1 ; k >= 0 ; k--)
-        sum += imgin->data[ppidx++] * kernel.data[k];
-      
-      imgout->data[outidx++] = sum;
+static void _convolveColumnRange(
+  const float *in,
+  int stride,
+  const float *kernel,
+  int width,
+  float *out,
+  int i0, int i1)
+{
+  int i, k;
+
+  for (i = i0 ; i < i1 ; i++)  {
+    const float *ppp = in + i;
+    float sum = 0.0;
+    for (k = width-1 ; k >= 0 ; k--)  {
+      sum += *ppp * kernel[k];
+      ppp += stride;
     }
+    out[i] = sum;
+  }
+}
+
+static void _convolveColumnsScalar(
+  const float *in,
+  int stride,
+  int ncols,
+  const float *kernel,
+  int width,
+  float *out)
+{
+  _convolveColumnRange(in, stride, kernel, width, out, 0, ncols);
+}
+
 
-    /* Zero rightmost columns */
-    for ( ; i < ncols ; i++)
-      imgout->data[outidx++] = 0.0;
+#ifdef KLT_X86_SIMD
 
-    rowidx += ncols;
+/* The AVX-512 target enables FMA, which gcc would otherwise use to
+   contract the separate multiply and add and so change the rounding */
+#define KLT_NO_CONTRACT optimize("fp-contract=off")
+
+__attribute__((target("sse2"), KLT_NO_CONTRACT))
+static void _convolveRowSSE2(
+  const float *in,
+  int ncols,
+  const float *kernel,
+  int width,
+  float *out)
+{
+  int radius = width / 2;
+  int i = radius, k;
+
+  _convolveRowBorders(ncols, width, out);
+  for ( ; i + 4 <= ncols - radius ; i += 4)  {
+    const float *ppp = in + i - radius;
+    __m128 sum = _mm_setzero_ps();
+    for (k = width-1 ; k >= 0 ; k--)
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(ppp++),
+                                       _mm_set1_ps(kernel[k])));
+    _mm_storeu_ps(out + i, sum);
   }
+  _convolveRowRange(in, kernel, width, out, i, ncols - radius);
 }
 
+__attribute__((target("sse2"), KLT_NO_CONTRACT))
+static void _convolveColumnsSSE2(
+  const float *in,
+  int stride,
+  int ncols,
+  const float *kernel,
+  int width,
+  float *out)
+{
+  int i = 0, k;
+
+  for ( ; i + 8 <= ncols ; i += 8)  {
+    const float *ppp = in + i;
+    __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+    for (k = width-1 ; k >= 0 ; k--)  {
+      __m128 coeff = _mm_set1_ps(kernel[k]);
+      sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(ppp), coeff));
+      sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(ppp + 4), coeff));
+      ppp += stride;
+    }
+    _mm_storeu_ps(out + i, sum0);
+    _mm_storeu_ps(out + i + 4, sum1);
+  }
+  _convolveColumnRange(in, stride, kernel, width, out, i, ncols);
+}
+
+__attribute__((target("avx2"), KLT_NO_CONTRACT))
+static void _convolveRowAVX2(
+  const float *in,
+  int ncols,
+  const float *kernel,
+  int width,
+  float *out)
+{
+  int radius = width / 2;
+  int i = radius, k;
+
+  _convolveRowBorders(ncols, width, out);
+  for ( ; i + 8 <= ncols - radius ; i += 8)  {
+    const float *ppp = in + i - radius;
+    __m256 sum = _mm256_setzero_ps();
+    for (k = width-1 ; k >= 0 ; k--)
+      sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(ppp++),
+                                             _mm256_set1_ps(kernel[k])));
+    _mm256_storeu_ps(out + i, sum);
+  }
+  _convolveRowRange(in, kernel, width, out, i, ncols - radius);
+}
+
+__attribute__((target("avx2"), KLT_NO_CONTRACT))
+static void _convolveColumnsAVX2(
+  const float *in,
+  int stride,
+  int ncols,
+  const float *kernel,
+  int width,
+  float *out)
+{
+  int i = 0, k;
+
+  for ( ; i + 16 <= ncols ; i += 16)  {
+    const float *ppp = in + i;
+    __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+    for (k = width-1 ; k >= 0 ; k--)  {
+      __m256 coeff = _mm256_set1_ps(kernel[k]);
+      sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(_mm256_loadu_ps(ppp), coeff));
+      sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(_mm256_loadu_ps(ppp + 8), coeff));
+      ppp += stride;
+    }
+    _mm256_storeu_ps(out + i, sum0);
+    _mm256_storeu_ps(out + i + 8, sum1);
+  }
+  _convolveColumnRange(in, stride, kernel, width, out, i, ncols);
+}
+
+__attribute__((target("avx512f"), KLT_NO_CONTRACT))
+static void _convolveRowAVX512(
+  const float *in,
+  int ncols,
+  const float *kernel,
+  int width,
+  float *out)
+{
+  int radius = width / 2;
+  int i = radius, k;
+
+  _convolveRowBorders(ncols, width, out);
+  for ( ; i + 16 <= ncols - radius ; i += 16)  {
+    const float *ppp = in + i - radius;
+    __m512 sum = _mm512_setzero_ps();
+    for (k = width-1 ; k >= 0 ; k--)
+      sum = _mm512_add_ps(sum, _mm512_mul_ps(_mm512_loadu_ps(ppp++),
+                                             _mm512_set1_ps(kernel[k])));
+    _mm512_storeu_ps(out + i, sum);
+  }
+  _convolveRowRange(in, kernel, width, out, i, ncols - radius);
+}
+
+__attribute__((target("avx512f"), KLT_NO_CONTRACT))
+static void _convolveColumnsAVX512(
+  const float *in,
+  int stride,
+  int ncols,
+  const float *kernel,
+  int width,
+  float *out)
+{
+  int i = 0, k;
+
+  for ( ; i + 32 <= ncols ; i += 32)  {
+    const float *ppp = in + i;
+    __m512 sum0 = _mm512_setzero_ps(), sum1 = _mm512_setzero_ps();
+    for (k = width-1 ; k >= 0 ; k--)  {
+      __m512 coeff = _mm512_set1_ps(kernel[k]);
+      sum0 = _mm512_add_ps(sum0, _mm512_mul_ps(_mm512_loadu_ps(ppp), coeff));
+      sum1 = _mm512_add_ps(sum1, _mm512_mul_ps(_mm512_loadu_ps(ppp + 16), coeff));
+      ppp += stride;
+    }
+    _mm512_storeu_ps(out + i, sum0);
+    _mm512_storeu_ps(out + i + 16, sum1);
+  }
+  _convolveColumnRange(in, stride, kernel, width, out, i, ncols);
+}
+
+#endif	/* KLT_X86_SIMD */
+
 
 /*********************************************************************
- * _convolveImageVert
+ * _convolveOps
+ *
+ * Picks the fastest set of primitives the CPU supports.  Setting the
+ * environment variable KLT_SIMD to "scalar", "sse2", "avx2" or
+ * "avx512" caps the choice, which is handy for checking the SIMD
+ * versions against the scalar reference.
  */
 
-static void _convolveImageVert(
-  _KLT_FloatImage imgin,
-  ConvolutionKernel kernel,
-  _KLT_FloatImage imgout)
+typedef struct  {
+  const char *name;
+  void (*row)(const float *in, int ncols,
+              const float *kernel, int width, float *out);
+  void (*columns)(const float *in, int stride, int ncols,
+                  const float *kernel, int width, float *out);
+}  _ConvolveOps;
+
+static const _ConvolveOps convolve_ops[] = {
+#ifdef KLT_X86_SIMD
+  { "avx512", _convolveRowAVX512, _convolveColumnsAVX512 },
+  { "avx2",   _convolveRowAVX2,   _convolveColumnsAVX2 },
+  { "sse2",   _convolveRowSSE2,   _convolveColumnsSSE2 },
+#endif
+  { "scalar", _convolveRowScalar, _convolveColumnsScalar },
+};
+
+static KLT_BOOL _cpuSupports(
+  const char *name)
 {
-  int colidx = 0;
-  int outidx = 0;
-  int ppidx;
-  register float sum;
-  register int radius = kernel.width / 2;
-  register int ncols = imgin->ncols, nrows = imgin->nrows;
-  register int i, j, k;
+#ifdef KLT_X86_SIMD
+  __builtin_cpu_init();
+  if (strcmp(name, "avx512") == 0)  return __builtin_cpu_supports("avx512f");
+  if (strcmp(name, "avx2") == 0)  return __builtin_cpu_supports("avx2");
+  if (strcmp(name, "sse2") == 0)  return __builtin_cpu_supports("sse2");
+#endif
+  return strcmp(name, "scalar") == 0;
+}
 
-  /* Kernel width must be odd */
-  assert(kernel.width % 2 == 1);
+static const _ConvolveOps *chosen_ops = NULL;
+static pthread_once_t chosen_ops_once = PTHREAD_ONCE_INIT;
 
-  /* Must read from and write to different images */
-  assert(imgin != imgout);
+static void _chooseConvolveOps(void)
+{
+  const int nops = sizeof(convolve_ops) / sizeof(convolve_ops[0]);
+  const char *cap;
+  int i;
 
-  /* require input cols to be a multiple of 8 */
-  assert(ncols % 8 == 0);
+  /* Skip anything faster than the requested cap */
+  cap = getenv("KLT_SIMD");
+  i = 0;
+  if (cap != NULL)  {
+    while (i < nops - 1 && strcmp(convolve_ops[i].name, cap) != 0)  i++;
+    if (strcmp(convolve_ops[i].name, cap) != 0)
+      KLTWarning("(_convolveOps) Unknown KLT_SIMD '%s'; using scalar", cap);
+  }
+  while (!_cpuSupports(convolve_ops[i].name))  i++;
 
-  /* Output image must be large enough to hold result */
-  assert(imgout->ncols >= imgin->ncols);
-  assert(imgout->nrows >= imgin->nrows);
+  chosen_ops = &convolve_ops[i];
+}
+
+/* Chosen once, on first use, whichever thread gets there first */
+static const _ConvolveOps *_convolveOps(void)
+{
+  pthread_once(&chosen_ops_once, _chooseConvolveOps);
+  return chosen_ops;
+}
 
-#if 0
-  /* For each column, do ... */
-  for (i = 0 ; i < ncols ; i++)  {
 
-    /* Zero topmost rows */
-    for (j = 0 ; j < radius ; j++)  {
-      imgout->data[outidx] = 0.0;
-      outidx += ncols;
+/*********************************************************************
+ * _convolveSeparate
+ *
+ * Convolves imgin with one or two separable kernel pairs, writing one
+ * output image per pair.  The output rows are split into one band per
+ * thread of the tracking context, and each band is processed in
+ * strips of rows:  the horizontal passes for the rows a strip needs
+ * go into buffers sized to stay in the L2 cache, and the vertical
+ * passes produce the strip's output rows from them.  Rows shared with
+ * the next strip are slid up the buffers rather than recomputed, so
+ * no full-size temporary image is needed; only the halo rows at the
+ * top of each band are computed twice.  With two pairs (the
+ * gradients), both horizontal passes run back to back on each input
+ * row while it is in cache.  Every output pixel is computed the same
+ * way whatever the banding, so results do not depend on nThreads.
+ */
+
+#define STRIP_BYTES  (256*1024)  /* target size of the strip buffers */
+#define MAX_PASSES   2
+
+typedef struct  {
+  _KLT_FloatImage imgin;
+  int npasses;
+  ConvolutionKernel **horiz_kernel;
+  ConvolutionKernel **vert_kernel;
+  _KLT_FloatImage *imgout;
+  int nbands;
+  int halo;			/* largest vertical kernel radius */
+  int strip;			/* output rows per strip */
+  int bufstride;
+  float *buf;			/* npasses*(strip+2*halo) rows per band */
+}  _SeparableJob;
+
+static void _convolveBand(
+  void *arg,
+  int band)
+{
+  _SeparableJob *job = (_SeparableJob *) arg;
+  const _ConvolveOps *ops = _convolveOps();
+  _KLT_FloatImage imgin = job->imgin;
+  int npasses = job->npasses;
+  int ncols = imgin->ncols, nrows = imgin->nrows;
+  int ybegin = band * nrows / job->nbands;
+  int yend = (band+1) * nrows / job->nbands;
+  int bufstride = job->bufstride;
+  int halo = job->halo;
+  int strip = job->strip;
+  int nbuf = strip + 2*halo;
+  int first, filled = 0;        /* rows [first, first+filled) are in buffers */
+  float *buf[MAX_PASSES];
+  int y0, y1, lo, hi, i, j, p;
+
+  buf[0] = job->buf + band * npasses * nbuf * bufstride;
+  for (p = 1 ; p < npasses ; p++)
+    buf[p] = buf[p-1] + nbuf * bufstride;
+
+  first = max(ybegin - halo, 0);
+  for (y0 = ybegin ; y0 < yend ; y0 += strip)  {
+    y1 = min(y0 + strip, yend);
+    lo = max(y0 - halo, 0);
+    hi = min(y1 + halo, nrows);
+
+    /* Slide rows still needed to the top of the buffers */
+    if (lo > first)  {
+      int keep = first + filled - lo;
+      if (keep > 0)
+        for (p = 0 ; p < npasses ; p++)
+          memmove(buf[p], buf[p] + (lo-first)*bufstride,
+                  keep*bufstride*sizeof(float));
+      filled = max(keep, 0);
+      first = lo;
     }
 
-    /* Convolve middle rows with kernel */
-    for ( ; j < nrows - radius ; j++)  {
-      ppidx = colidx + ncols * (j - radius);
-      sum = 0.0;
-      for (k = kernel.width-1 ; k >= 0 ; k--)  {
-        sum += imgin->data[ppidx] * kernel.data[k];
-        ppidx += ncols;
+    /* Horizontal passes for the new rows */
+    for (j = first + filled ; j < hi ; j++)  {
+      const float *in = imgin->data + j*imgin->stride;
+      for (p = 0 ; p < npasses ; p++)
+        ops->row(in, ncols, job->horiz_kernel[p]->data,
+                 job->horiz_kernel[p]->width, buf[p] + (j-first)*bufstride);
+    }
+    filled = hi - first;
+
+    /* Vertical passes for the strip, zeroing rows lost to the kernel */
+    for (p = 0 ; p < npasses ; p++)  {
+      ConvolutionKernel *kernel = job->vert_kernel[p];
+      _KLT_FloatImage imgout = job->imgout[p];
+      int radius = kernel->width / 2;
+
+      for (j = y0 ; j < y1 ; j++)  {
+        float *out = imgout->data + j*imgout->stride;
+
+        if (j < radius || j >= nrows - radius)
+          for (i = 0 ; i < ncols ; i++)  out[i] = 0.0;
+        else
+          ops->columns(buf[p] + (j-radius-first)*bufstride, bufstride, ncols,
+                       kernel->data, kernel->width, out);
       }
-      imgout->data[outidx] = sum;
-      outidx += ncols;
     }
+  }
+}
 
-    /* Zero bottommost rows */
-    for ( ; j < nrows ; j++)  {
-      imgout->data[outidx] = 0.;
-      outidx += ncols;
-    }
+static void _convolveSeparate(
+  KLT_TrackingContext tc,
+  _KLT_FloatImage imgin,
+  int npasses,
+  ConvolutionKernel *horiz_kernel[],
+  ConvolutionKernel *vert_kernel[],
+  _KLT_FloatImage imgout[])
+{
+  _SeparableJob job;
+  int p;
 
-    colidx++;
-    outidx -= nrows * ncols - 1;
-  }
-#else
-  /* alternate loop structure: go across the output image, but we're
-     still going down the input image.
-  */
-  /* Zero top */
-  outidx = 0;
-  for(j = 0; j < (ncols*radius); j++)
-    imgout->data[outidx++] = 0.;
-
-  /* For each row, do ... */
-  for (j = radius ; j < nrows-radius ; j++)  {
-#if !__OPTIMIZE__
-    /* Convolve middle columns with kernel */
-    for (i = 0 ; i < ncols ; i++)  {
-      int ppidx = (j-radius)*ncols + i;
-      float sum = 0.0;
-      for (k = kernel.width-1 ; k >= 0 ; k--) {
-        sum += imgin->data[ppidx] * kernel.data[k];
-	ppidx += ncols;
-      }
-      
-      imgout->data[outidx++] = sum;
-#else  /* __OPTIMIZE__ */
-#ifdef USE_SSE
-    assert((intptr_t)(imgin->data) % 16 == 0);
-    for (i = 0 ; i < ncols ; i += 8)  {
-      int ppidx = (j-radius)*ncols + i;
-      __m128 sum0, sum1;
-      float *in = &imgin->data[ppidx];
-      sum0 = sum1 = _mm_set_ps(0,0,0,0);
-
-      for (k = kernel.width-1 ; k >= 0 ; k--) {
-	__m128 coeff;
-	coeff = _mm_load1_ps(&kernel.data[k]);
-
-	_mm_prefetch(&in[32], _MM_HINT_NTA);
-	sum0 += _mm_load_ps(&in[0]) * coeff;
-	sum1 += _mm_load_ps(&in[4]) * coeff;
-	in += ncols;
-      }
+  assert(npasses >= 1 && npasses <= MAX_PASSES);
+  for (p = 0 ; p < npasses ; p++)  {
+    /* Kernel widths must be odd */
+    assert(horiz_kernel[p]->width % 2 == 1);
+    assert(vert_kernel[p]->width % 2 == 1);
 
-      _mm_stream_ps(&imgout->data[outidx+0], sum0);
-      _mm_stream_ps(&imgout->data[outidx+4], sum1);
-      outidx += 8;
-#else  /* !USE_SSE */
-    /* This should be vectorizable so that the unrolled sum[0-3]
-       calculations are done in parallel. */
-    for (i = 0 ; i < ncols ; i += 4)  {
-      int ppidx = (j-radius)*ncols + i;
-      float sum0, sum1, sum2, sum3;
-      sum0 = sum1 = sum2 = sum3 = 0.f;
-
-      for (k = kernel.width-1 ; k >= 0 ; k--) {
-	float coeff = kernel.data[k];
-        sum0 += imgin->data[ppidx+0] * coeff;
-        sum1 += imgin->data[ppidx+1] * coeff;
-        sum2 += imgin->data[ppidx+2] * coeff;
-        sum3 += imgin->data[ppidx+3] * coeff;
-	ppidx += ncols;
-      }
-      
-      imgout->data[outidx+0] = sum0;
-      imgout->data[outidx+1] = sum1;
-      imgout->data[outidx+2] = sum2;
-      imgout->data[outidx+3] = sum3;
-      outidx += 4;
-#endif	/* USE_SSE */
-#endif	/* __OPTIMIZE__ */
-    }
+    /* Must read from and write to different images */
+    assert(imgout[p] != imgin);
+
+    /* Output images must be large enough to hold result */
+    assert(imgout[p]->ncols >= imgin->ncols);
+    assert(imgout[p]->nrows >= imgin->nrows);
   }
-  /* Zero bottom */
-  for (i = 0; i < ncols*radius; i++)
-    imgout->data[outidx++] = 0.0;
 
-#endif
+  job.imgin = imgin;
+  job.npasses = npasses;
+  job.horiz_kernel = horiz_kernel;
+  job.vert_kernel = vert_kernel;
+  job.imgout = imgout;
+  job.nbands = max(1, min(tc->nThreads, imgin->nrows));
+
+  /* Choose strip height so that the buffers fit in cache */
+  job.halo = 0;
+  for (p = 0 ; p < npasses ; p++)
+    job.halo = max(job.halo, vert_kernel[p]->width / 2);
+  job.bufstride = _KLTRowStride(imgin->ncols);
+  job.strip = STRIP_BYTES / (npasses * job.bufstride * sizeof(float)) -
+    2*job.halo;
+  if (job.strip < 16)  job.strip = 16;
+  job.buf = (float *) _KLTGetScratch(tc, _KLT_SCRATCH_CONVOLVE,
+    job.nbands * npasses * (job.strip + 2*job.halo) * job.bufstride *
+    sizeof(float));
+
+  _KLTRunTasks(tc, job.nbands, _convolveBand, &job);
 }
 
 
 /*********************************************************************
- * _convolveSeparate
+ * _smoothRecursive
+ *
+ * Smooths an image with the recursive Gaussian of Young and van Vliet
+ * ("Recursive implementation of the Gaussian filter", Signal
+ * Processing 44, 1995):  a third-order causal filter followed by the
+ * same filter run backwards, first along the rows and then down the
+ * columns.  Its cost per pixel does not depend on sigma, so it is used
+ * in place of the FIR kernel once that gets wide (see iir_min_width).
+ * The filters start from the steady state for the first sample, as
+ * if the image were extended by replicating its edges, and a border
+ * of the FIR kernel's half-width is zeroed as in _convolveSeparate, so
+ * borders and invalid pixels are the same whichever is used.  Rows
+ * are split into bands for the horizontal pass and columns into bands
+ * for the vertical pass, which runs on whole runs of each row at a
+ * time so that it vectorizes.
  */
 
-static void _convolveSeparate(
+typedef struct  {
+  float B, b1, b2, b3;		/* b1..b3 already divided by b0 */
+}  _RecursiveGauss;
+
+typedef struct  {
+  _KLT_FloatImage imgin;
+  _KLT_FloatImage imgout;
+  _RecursiveGauss coef;
+  int radius;			/* border to zero */
+  int nbands;
+}  _RecursiveJob;
+
+static void _recursiveGaussCoefficients(
+  float sigma,
+  _RecursiveGauss *coef)
+{
+  double q, q2, q3, b0;
+
+  assert(sigma >= 0.5);
+
+  if (sigma >= 2.5)
+    q = 0.98711*sigma - 0.96330;
+  else
+    q = 3.97156 - 4.14554*sqrt(1.0 - 0.26891*sigma);
+  q2 = q*q;  q3 = q2*q;
+
+  b0 = 1.57825 + 2.44413*q + 1.4281*q2 + 0.422205*q3;
+  coef->b1 = (float) ((2.44413*q + 2.85619*q2 + 1.26661*q3) / b0);
+  coef->b2 = (float) (-(1.4281*q2 + 1.26661*q3) / b0);
+  coef->b3 = (float) (0.422205*q3 / b0);
+  coef->B = 1.0f - (coef->b1 + coef->b2 + coef->b3);
+}
+
+static void _smoothRecursiveRows(
+  void *arg,
+  int band)
+{
+  _RecursiveJob *job = (_RecursiveJob *) arg;
+  const _RecursiveGauss *c = &job->coef;
+  int ncols = job->imgin->ncols, nrows = job->imgin->nrows;
+  int ybegin = band * nrows / job->nbands;
+  int yend = (band+1) * nrows / job->nbands;
+  int radius = min(job->radius, ncols);
+  int i, j;
+
+  for (j = ybegin ; j < yend ; j++)  {
+    const float *in = job->imgin->data + j*job->imgin->stride;
+    float *out = job->imgout->data + j*job->imgout->stride;
+    float w1, w2, w3, w;
+
+    /* Causal pass */
+    w1 = w2 = w3 = in[0];
+    for (i = 0 ; i < ncols ; i++)  {
+      w = c->B*in[i] + c->b1*w1 + c->b2*w2 + c->b3*w3;
+      out[i] = w;
+      w3 = w2;  w2 = w1;  w1 = w;
+    }
+
+    /* Anti-causal pass */
+    w1 = w2 = w3 = out[ncols-1];
+    for (i = ncols-1 ; i >= 0 ; i--)  {
+      w = c->B*out[i] + c->b1*w1 + c->b2*w2 + c->b3*w3;
+      out[i] = w;
+      w3 = w2;  w2 = w1;  w1 = w;
+    }
+
+    for (i = 0 ; i < radius ; i++)  out[i] = 0.0;
+    for (i = ncols - radius ; i < ncols ; i++)  out[i] = 0.0;
+  }
+}
+
+static void _smoothRecursiveColumns(
+  void *arg,
+  int band)
+{
+  _RecursiveJob *job = (_RecursiveJob *) arg;
+  const _RecursiveGauss *c = &job->coef;
+  _KLT_FloatImage img = job->imgout;
+  int ncols = img->ncols, nrows = img->nrows;
+  int stride = img->stride;
+  int nblocks = (ncols + 15) / 16;	/* bands start on cache lines */
+  int xbegin = min(band * nblocks / job->nbands * 16, ncols);
+  int xend = min((band+1) * nblocks / job->nbands * 16, ncols);
+  int radius = min(job->radius, nrows);
+  int i, j;
+
+  /* Causal pass.  Rows before the first are copies of it, so, */
+  /* starting in the steady state, row 0 is unchanged. */
+  for (j = 1 ; j < nrows ; j++)  {
+    float *out = img->data + j*stride;
+    const float *r1 = img->data + (j-1)*stride;
+    const float *r2 = img->data + max(j-2, 0)*stride;
+    const float *r3 = img->data + max(j-3, 0)*stride;
+    for (i = xbegin ; i < xend ; i++)
+      out[i] = c->B*out[i] + c->b1*r1[i] + c->b2*r2[i] + c->b3*r3[i];
+  }
+
+  /* Anti-causal pass, likewise leaving the last row unchanged */
+  for (j = nrows-2 ; j >= 0 ; j--)  {
+    float *out = img->data + j*stride;
+    const float *r1 = img->data + (j+1)*stride;
+    const float *r2 = img->data + min(j+2, nrows-1)*stride;
+    const float *r3 = img->data + min(j+3, nrows-1)*stride;
+    for (i = xbegin ; i < xend ; i++)
+      out[i] = c->B*out[i] + c->b1*r1[i] + c->b2*r2[i] + c->b3*r3[i];
+  }
+
+  for (j = 0 ; j < nrows ; j++)
+    if (j < radius || j >= nrows - radius)
+      for (i = xbegin ; i < xend ; i++)
+        img->data[j*stride + i] = 0.0;
+}
+
+static KLT_BOOL _useRecursive(
+  KLT_TrackingContext tc,
+  ConvolutionKernel *gauss,
+  float sigma)
+{
+  /* The recursive filter is only defined for sigma >= 0.5 */
+  return tc->iir_min_width > 0 && gauss->width >= tc->iir_min_width &&
+         sigma >= 0.5;
+}
+
+static void _smoothRecursive(
+  KLT_TrackingContext tc,
   _KLT_FloatImage imgin,
-  ConvolutionKernel horiz_kernel,
-  ConvolutionKernel vert_kernel,
+  float sigma,
+  int radius,
   _KLT_FloatImage imgout)
 {
-  /* Create temporary image */
-  _KLT_FloatImage tmpimg;
-  tmpimg = _KLTCreateFloatImage(imgin->ncols, imgin->nrows);
-  
-  /* Do convolution */
-  _convolveImageHoriz(imgin, horiz_kernel, tmpimg);
+  _RecursiveJob job;
+
+  /* Must read from and write to different images */
+  assert(imgout != imgin);
+
+  job.imgin = imgin;
+  job.imgout = imgout;
+  job.radius = radius;
+  _recursiveGaussCoefficients(sigma, &job.coef);
 
-  _convolveImageVert(tmpimg, vert_kernel, imgout);
+  job.nbands = max(1, min(tc->nThreads, imgin->nrows));
+  _KLTRunTasks(tc, job.nbands, _smoothRecursiveRows, &job);
 
-  /* Free memory */
-  _KLTFreeFloatImage(tmpimg);
+  job.nbands = max(1, min(tc->nThreads, (imgin->ncols + 15) / 16));
+  _KLTRunTasks(tc, job.nbands, _smoothRecursiveColumns, &job);
 }
 
-	
+
 /*********************************************************************
  * _KLTComputeGradients
  */
 
 void _KLTComputeGradients(
+  KLT_TrackingContext tc,
   _KLT_FloatImage img,
   float sigma,
   _KLT_FloatImage gradx,
   _KLT_FloatImage grady)
 {
-				
+  _KernelPair *kernels;
+
   /* Output images must be large enough to hold result */
   assert(gradx->ncols >= img->ncols);
   assert(gradx->nrows >= img->nrows);
   assert(grady->ncols >= img->ncols);
   assert(grady->nrows >= img->nrows);
 
-  /* Compute kernels, if necessary */
-  if (fabs(sigma - sigma_last) > 0.05)
-    _computeKernels(sigma, &gauss_kernel, &gaussderiv_kernel);
-	
-  _convolveSeparate(img, gaussderiv_kernel, gauss_kernel, gradx);
-  _convolveSeparate(img, gauss_kernel, gaussderiv_kernel, grady);
+  kernels = _getKernels(tc, sigma);
+  {
+    ConvolutionKernel *horiz[2], *vert[2];
+    _KLT_FloatImage out[2];
+
+    horiz[0] = &kernels->gaussderiv;  vert[0] = &kernels->gauss;  out[0] = gradx;
+    horiz[1] = &kernels->gauss;  vert[1] = &kernels->gaussderiv;  out[1] = grady;
+    _convolveSeparate(tc, img, 2, horiz, vert, out);
+  }
 
 }
 	
 
+/*********************************************************************
+ * _KLTComputeSobelGradients
+ *
+ * Gradients of an image straight from its pixels with the 3x3 Sobel
+ * operator, scaled by 1/8 to be in the same units as those of
+ * _KLTComputeGradients.  Much cheaper than smoothing and convolving
+ * with Gaussian derivatives, for detectors that need only rough
+ * gradients.  The operator is applied as a horizontal pass over each
+ * row, [1 2 1] and [-1 0 1], kept for three rows at a time, then a
+ * vertical one.  As with the convolutions, the border is zeroed.
+ * Everything is exact in integers, so the SSE2 paths give the same
+ * results as the scalar ones.  Only rows y0 to y1-1 are computed,
+ * reading the image a row above and below them; the other rows of
+ * gradx and grady are left as they were.
+ */
+
+static void _sobelRow(
+  const KLT_PixelType *in,
+  int ncols,
+  float *hs,
+  float *hd)
+{
+  int i = 1;
+
+#ifdef __SSE2__
+  {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a, b, c, sum, diff;
+
+    for ( ; i + 9 <= ncols ; i += 8)  {
+      a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in + i - 1)),
+                            zero);
+      b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in + i)),
+                            zero);
+      c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in + i + 1)),
+                            zero);
+      sum = _mm_add_epi16(_mm_add_epi16(a, c), _mm_add_epi16(b, b));
+      diff = _mm_sub_epi16(c, a);
+      _mm_storeu_ps(hs + i,
+                    _mm_cvtepi32_ps(_mm_unpacklo_epi16(sum, zero)));
+      _mm_storeu_ps(hs + i + 4,
+                    _mm_cvtepi32_ps(_mm_unpackhi_epi16(sum, zero)));
+      _mm_storeu_ps(hd + i, _mm_cvtepi32_ps(
+                      _mm_srai_epi32(_mm_unpacklo_epi16(diff, diff), 16)));
+      _mm_storeu_ps(hd + i + 4, _mm_cvtepi32_ps(
+                      _mm_srai_epi32(_mm_unpackhi_epi16(diff, diff), 16)));
+    }
+  }
+#endif
+
+  for ( ; i < ncols - 1 ; i++)  {
+    hs[i] = (float) (in[i-1] + 2*in[i] + in[i+1]);
+    hd[i] = (float) (in[i+1] - in[i-1]);
+  }
+}
+
+static void _sobelColumns(
+  const float *s0, const float *s2,
+  const float *d0, const float *d1, const float *d2,
+  int ncols,
+  float *gx,
+  float *gy)
+{
+  int i = 1;
+
+#ifdef __SSE2__
+  {
+    const __m128 eighth = _mm_set1_ps(0.125f);
+    __m128 mid;
+
+    for ( ; i + 5 <= ncols ; i += 4)  {
+      mid = _mm_loadu_ps(d1 + i);
+      _mm_storeu_ps(gx + i, _mm_mul_ps(eighth, _mm_add_ps(
+        _mm_add_ps(_mm_loadu_ps(d0 + i), _mm_add_ps(mid, mid)),
+        _mm_loadu_ps(d2 + i))));
+      _mm_storeu_ps(gy + i, _mm_mul_ps(eighth, _mm_sub_ps(
+        _mm_loadu_ps(s2 + i), _mm_loadu_ps(s0 + i))));
+    }
+  }
+#endif
+
+  for ( ; i < ncols - 1 ; i++)  {
+    gx[i] = 0.125f * (d0[i] + 2.0f*d1[i] + d2[i]);
+    gy[i] = 0.125f * (s2[i] - s0[i]);
+  }
+}
+
+void _KLTComputeSobelGradients(
+  KLT_TrackingContext tc,
+  KLT_Image img,
+  int y0,
+  int y1,
+  _KLT_FloatImage gradx,
+  _KLT_FloatImage grady)
+{
+  int ncols = img->ncols, nrows = img->nrows;
+  float *buf, *hs[3], *hd[3], *gx, *gy;
+  KLT_PixelType *row;
+  int first, last;	/* image rows read */
+  int j, k;
+
+  /* Output images must be large enough to hold result */
+  assert(gradx->ncols >= ncols);
+  assert(gradx->nrows >= nrows);
+  assert(grady->ncols >= ncols);
+  assert(grady->nrows >= nrows);
+
+  gradx->ncols = grady->ncols = ncols;
+  gradx->nrows = grady->nrows = nrows;
+
+  buf = (float *) _KLTGetScratch(tc, _KLT_SCRATCH_CONVOLVE,
+                                 6 * ncols * sizeof(float) + ncols);
+  for (k = 0 ; k < 3 ; k++)  {
+    hs[k] = buf + 2*k*ncols;
+    hd[k] = hs[k] + ncols;
+  }
+  row = (KLT_PixelType *) (buf + 6*ncols);	/* for gathering strided rows */
+
+  if (y0 < 0)  y0 = 0;
+  if (y1 > nrows)  y1 = nrows;
+  for (j = y0 ; j < y1 ; j++)  {
+    gx = gradx->data + j*gradx->stride;
+    gy = grady->data + j*grady->stride;
+    memset(gx, 0, ncols * sizeof(float));
+    memset(gy, 0, ncols * sizeof(float));
+  }
+  if (ncols < 3 || nrows < 3)  return;
+
+  first = (y0 > 1) ? y0 - 1 : 0;
+  last = (y1 < nrows - 1) ? y1 : nrows - 1;
+  for (j = first ; j <= last ; j++)  {
+
+    /* Horizontal pass over row j, into the slot of row j-3 */
+    k = j % 3;
+    _sobelRow(_KLTImageRow(img, j, row), ncols, hs[k], hd[k]);
+
+    /* Vertical pass for the row above */
+    if (j >= first + 2)
+      _sobelColumns(hs[(j-2) % 3], hs[k],
+                    hd[(j-2) % 3], hd[(j-1) % 3], hd[k], ncols,
+                    gradx->data + (j-1)*gradx->stride,
+                    grady->data + (j-1)*grady->stride);
+  }
+}
+
+
 /*********************************************************************
  * _KLTComputeSmoothedImage
  */
 
 void _KLTComputeSmoothedImage(
+  KLT_TrackingContext tc,
   _KLT_FloatImage img,
   float sigma,
   _KLT_FloatImage smooth)
 {
+  _KernelPair *kernels;
+
   /* Output image must be large enough to hold result */
   assert(smooth->ncols >= img->ncols);
   assert(smooth->nrows >= img->nrows);
 
-  /* Compute kernel, if necessary; gauss_deriv is not used */
-  if (fabs(sigma - sigma_last) > 0.05)
-    _computeKernels(sigma, &gauss_kernel, &gaussderiv_kernel);
+  /* gauss_deriv is not used */
+  kernels = _getKernels(tc, sigma);
+  {
+    ConvolutionKernel *gauss = &kernels->gauss;
+    if (_useRecursive(tc, gauss, sigma))
+      _smoothRecursive(tc, img, sigma, gauss->width/2, smooth);
+    else
+      _convolveSeparate(tc, img, 1, &gauss, &gauss, &smooth);
+  }
+}
 
-  _convolveSeparate(img, gauss_kernel, gauss_kernel, smooth);
+
+/*********************************************************************
+ * _KLTComputeSmoothedSubsampledImage
+ *
+ * Smooths an image and keeps every subsampling-th pixel in each
+ * direction, starting at subsampling/2, as when building a pyramid.
+ * The horizontal pass is evaluated only at the kept columns, and the
+ * vertical pass only at the kept rows and columns, in the same order
+ * as _convolveSeparate, so the result is exactly what subsampling the
+ * output of _KLTComputeSmoothedImage would give.  Each band of output
+ * rows keeps the horizontal results for the input rows it needs; at
+ * 1/subsampling of the input size they are small.  The recursive
+ * filter must see every pixel, so with it the whole image is smoothed
+ * and then subsampled.
+ */
+
+typedef struct  {
+  _KLT_FloatImage imgin;
+  ConvolutionKernel *kernel;
+  int subsampling;
+  _KLT_FloatImage imgout;
+  int ncols, nrows;		/* size of the output */
+  int nbands;
+  int bufrows;			/* input rows a band can need */
+  int bufstride;
+  float *buf;
+}  _DecimateJob;
+
+static void _convolveRowDecimated(
+  const float *in,
+  int ncols,
+  const float *kernel,
+  int width,
+  int subsampling,
+  float *out,
+  int nout)
+{
+  int radius = width / 2;
+  int i, k, x;
+
+  for (x = 0 ; x < nout ; x++)  {
+    i = subsampling*x + subsampling/2;
+    if (i < radius || i >= ncols - radius)
+      out[x] = 0.0;
+    else  {
+      const float *ppp = in + i - radius;
+      float sum = 0.0;
+      for (k = width-1 ; k >= 0 ; k--)
+        sum += *ppp++ * kernel[k];
+      out[x] = sum;
+    }
+  }
 }
 
+static void _convolveDecimatedBand(
+  void *arg,
+  int band)
+{
+  _DecimateJob *job = (_DecimateJob *) arg;
+  const _ConvolveOps *ops = _convolveOps();
+  _KLT_FloatImage imgin = job->imgin, imgout = job->imgout;
+  ConvolutionKernel *kernel = job->kernel;
+  int ss = job->subsampling;
+  int nrows = imgin->nrows;
+  int nout = job->ncols;
+  int radius = kernel->width / 2;
+  int ybegin = band * job->nrows / job->nbands;
+  int yend = (band+1) * job->nrows / job->nbands;
+  int bufstride = job->bufstride;
+  float *buf = job->buf + band * job->bufrows * bufstride;
+  int lo, hi, i, j, y;
+
+  if (ybegin >= yend)  return;
+
+  /* Input rows needed by the band's output rows */
+  lo = max(ss*ybegin + ss/2 - radius, 0);
+  hi = min(ss*(yend-1) + ss/2 + radius + 1, nrows);
+  assert(hi - lo <= job->bufrows);
+
+  for (j = lo ; j < hi ; j++)
+    _convolveRowDecimated(imgin->data + j*imgin->stride, imgin->ncols,
+                          kernel->data, kernel->width, ss,
+                          buf + (j-lo)*bufstride, nout);
+
+  for (y = ybegin ; y < yend ; y++)  {
+    float *out = imgout->data + y*imgout->stride;
+    j = ss*y + ss/2;
+
+    if (j < radius || j >= nrows - radius)
+      for (i = 0 ; i < nout ; i++)  out[i] = 0.0;
+    else
+      ops->columns(buf + (j-radius-lo)*bufstride, bufstride, nout,
+                   kernel->data, kernel->width, out);
+  }
+}
+
+void _KLTComputeSmoothedSubsampledImage(
+  KLT_TrackingContext tc,
+  _KLT_FloatImage img,
+  float sigma,
+  int subsampling,
+  _KLT_FloatImage out)
+{
+  ConvolutionKernel *gauss = &_getKernels(tc, sigma)->gauss;
+  int ncols = img->ncols / subsampling;
+  int nrows = img->nrows / subsampling;
+
+  assert(gauss->width % 2 == 1);
+  assert(out != img);
+
+  /* Output image must be large enough to hold result */
+  assert(out->ncols >= ncols);
+  assert(out->nrows >= nrows);
+
+  if (_useRecursive(tc, gauss, sigma))  {
+    _KLT_FloatImage tmpimg = _KLTGetScratchFloatImage(tc,
+      _KLT_SCRATCH_CONVOLVE_IMAGE, img->ncols, img->nrows);
+    int subhalf = subsampling / 2;
+    int x, y;
+
+    _smoothRecursive(tc, img, sigma, gauss->width/2, tmpimg);
+    for (y = 0 ; y < nrows ; y++)
+      for (x = 0 ; x < ncols ; x++)
+        out->data[y*out->stride+x] = 
+          tmpimg->data[(subsampling*y+subhalf)*tmpimg->stride +
+                       (subsampling*x+subhalf)];
+  } else  {
+    _DecimateJob job;
+
+    job.imgin = img;
+    job.kernel = gauss;
+    job.subsampling = subsampling;
+    job.imgout = out;
+    job.ncols = ncols;
+    job.nrows = nrows;
+    job.nbands = max(1, min(tc->nThreads, nrows));
+    job.bufrows = min(subsampling * ((nrows + job.nbands - 1) / job.nbands) +
+                      gauss->width, img->nrows);
+    job.bufstride = _KLTRowStride(ncols);
+    job.buf = (float *) _KLTGetScratch(tc, _KLT_SCRATCH_CONVOLVE,
+      job.nbands * job.bufrows * job.bufstride * sizeof(float));
+    _KLTRunTasks(tc, job.nbands, _convolveDecimatedBand, &job);
+  }
+}
+
+
+/*********************************************************************
+ * _convolveFixed
+ *
+ * Separable Gaussian smoothing in fixed point, for the tracking
+ * context's fixedPoint mode.  The input is either 8-bit pixels (in8),
+ * whose rows are gathered into a buffer first if they are strided, or
+ * a fixed-point image (in16); the output is a fixed-point image.
+ * Products are accumulated in 32 bits and rounded back to 16 bits
+ * after each pass.  The loops run over whole rows of accumulators so
+ * that the compiler can vectorize them.  Borders are zeroed, as in
+ * the floating-point path.  Each pass is split into row bands, one
+ * per thread.
+ */
+
+typedef struct  {
+  KLT_Image in8;
+  const short *in16;
+  int ncols, nrows;
+  const short *kernel;
+  int width;
+  short *tmp;
+  short *out;
+  int nbands;
+  int *acc;			/* one row of accumulators per band */
+  KLT_PixelType *gather;	/* and one row of input pixels */
+  int accstride;
+}  _FixedJob;
+
+static void _convolveFixedHorizBand(
+  void *arg,
+  int band)
+{
+  _FixedJob *job = (_FixedJob *) arg;
+  int ncols = job->ncols, width = job->width;
+  int radius = width / 2;
+  int inner = ncols - 2*radius;   /* # of columns not lost to the kernel */
+  int hshift = (job->in8 != NULL) ? KERNEL_SHIFT - _KLT_FIXED_SHIFT 
+                                  : KERNEL_SHIFT;
+  int ybegin = band * job->nrows / job->nbands;
+  int yend = (band+1) * job->nrows / job->nbands;
+  int *acc = job->acc + band * job->accstride;
+  int i, j, k;
+
+  for (j = ybegin ; j < yend ; j++)  {
+    short *row = job->tmp + j*ncols;
+
+    for (i = 0 ; i < ncols ; i++)  row[i] = 0;
+    if (inner <= 0)  continue;
+
+    for (i = 0 ; i < inner ; i++)  acc[i] = 1 << (hshift - 1);
+    if (job->in8 != NULL)  {
+      const KLT_PixelType *in = _KLTImageRow(job->in8, j,
+                                   job->gather + band * job->accstride);
+      for (k = width-1 ; k >= 0 ; k--)  {
+        const KLT_PixelType *ppp = in + (width-1-k);
+        int coeff = job->kernel[k];
+        for (i = 0 ; i < inner ; i++)  acc[i] += ppp[i] * coeff;
+      }
+    } else  {
+      for (k = width-1 ; k >= 0 ; k--)  {
+        const short *ppp = job->in16 + j*ncols + (width-1-k);
+        int coeff = job->kernel[k];
+        for (i = 0 ; i < inner ; i++)  acc[i] += ppp[i] * coeff;
+      }
+    }
+    for (i = 0 ; i < inner ; i++)  row[radius+i] = (short) (acc[i] >> hshift);
+  }
+}
 
+static void _convolveFixedVertBand(
+  void *arg,
+  int band)
+{
+  _FixedJob *job = (_FixedJob *) arg;
+  int ncols = job->ncols, nrows = job->nrows, width = job->width;
+  int radius = width / 2;
+  int ybegin = band * nrows / job->nbands;
+  int yend = (band+1) * nrows / job->nbands;
+  int *acc = job->acc + band * job->accstride;
+  int i, j, k;
+
+  for (j = ybegin ; j < yend ; j++)  {
+    short *row = job->out + j*ncols;
+
+    if (j < radius || j >= nrows - radius)  {
+      for (i = 0 ; i < ncols ; i++)  row[i] = 0;
+      continue;
+    }
 
+    for (i = 0 ; i < ncols ; i++)  acc[i] = 1 << (KERNEL_SHIFT - 1);
+    for (k = width-1 ; k >= 0 ; k--)  {
+      const short *ppp = job->tmp + (j-radius+width-1-k)*ncols;
+      int coeff = job->kernel[k];
+      for (i = 0 ; i < ncols ; i++)  acc[i] += ppp[i] * coeff;
+    }
+    for (i = 0 ; i < ncols ; i++)  row[i] = (short) (acc[i] >> KERNEL_SHIFT);
+  }
+}
+
+static void _convolveFixed(
+  KLT_TrackingContext tc,
+  KLT_Image in8,
+  const short *in16,
+  int ncols, int nrows,
+  const short *kernel,
+  int width,
+  short *out)
+{
+  _FixedJob job;
+
+  assert(width % 2 == 1);
+  assert((in8 == NULL) != (in16 == NULL));
+
+  job.in8 = in8;
+  job.in16 = in16;
+  job.ncols = ncols;
+  job.nrows = nrows;
+  job.kernel = kernel;
+  job.width = width;
+  job.out = out;
+  job.nbands = max(1, min(tc->nThreads, nrows));
+  job.tmp = (short *) _KLTGetScratch(tc, _KLT_SCRATCH_CONVOLVE_IMAGE,
+                                     ncols * nrows * sizeof(short));
+  job.accstride = _KLTRowStride(ncols);	/* keeps bands on separate lines */
+  job.acc = (int *) _KLTGetScratch(tc, _KLT_SCRATCH_CONVOLVE,
+                                   job.nbands * job.accstride *
+                                   (sizeof(int) + sizeof(KLT_PixelType)));
+  job.gather = (KLT_PixelType *) (job.acc + job.nbands * job.accstride);
+
+  _KLTRunTasks(tc, job.nbands, _convolveFixedHorizBand, &job);
+  _KLTRunTasks(tc, job.nbands, _convolveFixedVertBand, &job);
+}
+
+
+/*********************************************************************
+ * _KLTToSmoothedFixedImage
+ *
+ * Smooths 8-bit image data straight into a fixed-point image, without
+ * widening it to floating point first.
+ */
+
+void _KLTToSmoothedFixedImage(
+  KLT_TrackingContext tc,
+  KLT_Image img,
+  float sigma,
+  _KLT_ShortImage smooth)
+{
+  int ncols = img->ncols, nrows = img->nrows;
+  _KernelPair *kernels;
+
+  /* Output image must be large enough to hold result */
+  assert(smooth->ncols >= ncols);
+  assert(smooth->nrows >= nrows);
+
+  smooth->ncols = ncols;
+  smooth->nrows = nrows;
+
+  kernels = _getKernels(tc, sigma);
+  _convolveFixed(tc, img, NULL, ncols, nrows,
+                 kernels->fixedgauss, kernels->gauss.width, smooth->data);
+}
+
+
+/*********************************************************************
+ * _KLTComputeSmoothedFixedImage
+ */
+
+void _KLTComputeSmoothedFixedImage(
+  KLT_TrackingContext tc,
+  _KLT_ShortImage img,
+  float sigma,
+  _KLT_ShortImage smooth)
+{
+  _KernelPair *kernels;
+
+  /* Output image must be large enough to hold result */
+  assert(smooth->ncols >= img->ncols);
+  assert(smooth->nrows >= img->nrows);
+
+  /* Must read from and write to different images */
+  assert(img != smooth);
+
+  kernels = _getKernels(tc, sigma);
+  _convolveFixed(tc, NULL, img->data, img->ncols, img->nrows,
+                 kernels->fixedgauss, kernels->gauss.width, smooth->data);
+}
+
+
+/*********************************************************************
+ * _KLTFixedToFloatImage
+ */
+
+void _KLTFixedToFloatImage(
+  _KLT_ShortImage img,
+  _KLT_FloatImage floatimg)
+{
+  const float scale = 1.0f / (1 << _KLT_FIXED_SHIFT);
+  const short *in = img->data;
+  int i, j;
+
+  /* Output image must be large enough to hold result */
+  assert(floatimg->ncols >= img->ncols);
+  assert(floatimg->nrows >= img->nrows);
+
+  floatimg->ncols = img->ncols;
+  floatimg->nrows = img->nrows;
+
+  for (j = 0 ; j < img->nrows ; j++)  {
+    float *out = floatimg->data + j*floatimg->stride;
+    for (i = 0 ; i < img->ncols ; i++)
+      out[i] = *in++ * scale;
+  }
+}
@@ -9,24 +9,62 @@
 #include "klt_util.h"
 
 void _KLTToFloatImage(
-  KLT_PixelType *img,
-  int ncols, int nrows,
+  KLT_Image img,
   _KLT_FloatImage floatimg);
 
 void _KLTComputeGradients(
+  KLT_TrackingContext tc,
   _KLT_FloatImage img,
   float sigma,
   _KLT_FloatImage gradx,
   _KLT_FloatImage grady);
 
+void _KLTComputeSobelGradients(
+  KLT_TrackingContext tc,
+  KLT_Image img,
+  int y0,
+  int y1,
+  _KLT_FloatImage gradx,
+  _KLT_FloatImage grady);
+
 void _KLTGetKernelWidths(
+  KLT_TrackingContext tc,
   float sigma,
   int *gauss_width,
   int *gaussderiv_width);
 
 void _KLTComputeSmoothedImage(
+  KLT_TrackingContext tc,
   _KLT_FloatImage img,
   float sigma,
   _KLT_FloatImage smooth);
 
+void _KLTComputeSmoothedSubsampledImage(
+  KLT_TrackingContext tc,
+  _KLT_FloatImage img,
+  float sigma,
+  int subsampling,
+  _KLT_FloatImage out);
+
+void _KLTToSmoothedFixedImage(
+  KLT_TrackingContext tc,
+  KLT_Image img,
+  float sigma,
+  _KLT_ShortImage smooth);
+
+void _KLTComputeSmoothedFixedImage(
+  KLT_TrackingContext tc,
+  _KLT_ShortImage img,
+  float sigma,
+  _KLT_ShortImage smooth);
+
+void _KLTFixedToFloatImage(
+  _KLT_ShortImage img,
+  _KLT_FloatImage floatimg);
+
+void *_KLTCreateKernelCache(void);
+
+void _KLTFreeKernelCache(
+  void *cache);
+
 #endif
@@ -0,0 +1,112 @@
+/**********************************************************************
+Times tracking the 150 best features of img0.pgm through img1.pgm and
+img2.pgm with the pyramids stored as floats, half floats and 16-bit
+integers, with the images smoothed in fixed point, and with the inverse
+compositional solver, and prints the iterations each took and how far
+their features end up from those of the default (float, forward
+additive) tracker.  An optional argument gives the number of times each
+is run (default 50).
+**********************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "pnmio.h"
+#include "klt.h"
+
+#define NFRAMES 3
+
+/* Returns the number of features tracked from frame to frame, and */
+/* adds up the iterations that took */
+static int track(
+  KLT_TrackingContext tc,
+  unsigned char **img,
+  int ncols,
+  int nrows,
+  KLT_FeatureList start,
+  KLT_FeatureList fl,
+  int *niterations)
+{
+  int nattempted = 0;
+  int i, j;
+
+  for (j = 0 ; j < fl->nFeatures ; j++)
+    *fl->feature[j] = *start->feature[j];
+  *niterations = 0;
+  for (i = 1 ; i < NFRAMES ; i++)  {
+    KLTTrackFeatures(tc, img[i-1], img[i], ncols, nrows, fl);
+    nattempted += tc->nTrackAttempted;
+    *niterations += tc->nTrackIterations;
+  }
+  return nattempted;
+}
+
+int main(int argc, char **argv)
+{
+  static const char *names[] = {"float", "half", "short", "fixed",
+                                "inverse"};
+  static const int storage[] = {KLT_STORE_FLOAT, KLT_STORE_HALF,
+                                KLT_STORE_SHORT, KLT_STORE_FLOAT,
+                                KLT_STORE_FLOAT};
+  static const KLT_BOOL fixed[] = {FALSE, FALSE, FALSE, TRUE, FALSE};
+  static const KLT_BOOL inverse[] = {FALSE, FALSE, FALSE, FALSE, TRUE};
+  unsigned char *img[NFRAMES];
+  char fname[100];
+  KLT_TrackingContext tc;
+  KLT_FeatureList start, fl, ref;
+  int nFeatures = 150;
+  int nreps = (argc > 1) ? atoi(argv[1]) : 50;
+  int ncols, nrows;
+  int i, j, k, r;
+
+  if (nreps < 1)  nreps = 1;
+
+  for (i = 0 ; i < NFRAMES ; i++)  {
+    sprintf(fname, "img%d.pgm", i);
+    img[i] = pgmReadFile(fname, NULL, &ncols, &nrows);
+  }
+
+  tc = KLTCreateTrackingContext();
+  tc->verbosity = 0;
+  start = KLTCreateFeatureList(nFeatures);
+  fl = KLTCreateFeatureList(nFeatures);
+  ref = KLTCreateFeatureList(nFeatures);
+  KLTSelectGoodFeatures(tc, img[0], ncols, nrows, start);
+
+  printf("          ms/sequence  us/feature  iter/feature  tracked  "
+         "max diff  mean diff\n");
+  for (k = 0 ; k < 5 ; k++)  {
+    clock_t t0;
+    double ms, maxd = 0.0, sumd = 0.0;
+    int nattempted, niterations, ntracked, nboth = 0;
+
+    tc->pyramidStorage = storage[k];
+    tc->fixedPoint = fixed[k];
+    tc->inverseCompositional = inverse[k];
+    track(tc, img, ncols, nrows, start, fl, &niterations);	/* warm up */
+    t0 = clock();
+    for (r = 0 ; r < nreps ; r++)
+      nattempted = track(tc, img, ncols, nrows, start, fl, &niterations);
+    ms = 1000.0 * (clock() - t0) / CLOCKS_PER_SEC / nreps;
+
+    if (k == 0)
+      for (j = 0 ; j < nFeatures ; j++)
+        *ref->feature[j] = *fl->feature[j];
+    for (j = 0 ; j < nFeatures ; j++)
+      if (fl->feature[j]->val >= 0 && ref->feature[j]->val >= 0)  {
+        double d = hypot(fl->feature[j]->x - ref->feature[j]->x,
+                         fl->feature[j]->y - ref->feature[j]->y);
+        if (d > maxd)  maxd = d;
+        sumd += d;
+        nboth++;
+      }
+    ntracked = KLTCountRemainingFeatures(fl);
+
+    printf("%-8s  %11.3f  %10.2f  %12.2f  %7d  %8.4f  %9.4f\n", names[k],
+           ms, 1000.0 * ms / nattempted, (double) niterations / nattempted,
+           ntracked, maxd, (nboth > 0) ? sumd / nboth : 0.0);
+  }
+
+  return 0;
+}
@@ -0,0 +1,63 @@
+/**********************************************************************
+Times selecting the 150 best features in img0.pgm with a square window
+of the size given as the first argument, or of sizes 7, 11 and 15 if
+none is given.  A second argument gives the number of times each is
+run (default 50).  Built against an older libklt.a, it gives the
+figures to compare with.
+**********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "pnmio.h"
+#include "klt.h"
+
+static void timeSelection(
+  unsigned char *img,
+  int ncols,
+  int nrows,
+  int size,
+  int nreps)
+{
+  KLT_TrackingContext tc;
+  KLT_FeatureList fl;
+  clock_t t0;
+  int r;
+
+  tc = KLTCreateTrackingContext();
+  tc->window_width = tc->window_height = size;
+  KLTUpdateTCBorder(tc);
+  fl = KLTCreateFeatureList(150);
+
+  KLTSelectGoodFeatures(tc, img, ncols, nrows, fl);	/* warm up */
+  t0 = clock();
+  for (r = 0 ; r < nreps ; r++)
+    KLTSelectGoodFeatures(tc, img, ncols, nrows, fl);
+  printf("%2dx%-2d window:  %7.3f ms, %d features\n", size, size,
+         1000.0 * (clock() - t0) / CLOCKS_PER_SEC / nreps,
+         KLTCountRemainingFeatures(fl));
+
+  KLTFreeFeatureList(fl);
+  KLTFreeTrackingContext(tc);
+}
+
+int main(int argc, char **argv)
+{
+  static const int sizes[] = {7, 11, 15};
+  unsigned char *img;
+  int nreps = (argc > 2) ? atoi(argv[2]) : 50;
+  int ncols, nrows;
+  int i;
+
+  if (nreps < 1)  nreps = 1;
+  KLTSetVerbosity(0);
+  img = pgmReadFile("img0.pgm", NULL, &ncols, &nrows);
+
+  if (argc > 1)
+    timeSelection(img, ncols, nrows, atoi(argv[1]), nreps);
+  else
+    for (i = 0 ; i < 3 ; i++)
+      timeSelection(img, ncols, nrows, sizes[i], nreps);
+
+  return 0;
+}
@@ -0,0 +1,125 @@
+/**********************************************************************
+Checks that tracking contexts can run on separate threads at once.
+Each of several contexts, set up differently, selects features in
+img0.pgm, tracks them through img1.pgm and img2.pgm and replaces those
+lost, a few times over; this is done once with the contexts one after
+another, then again with each on its own thread.  The features must
+come out the same, bit for bit.  An optional argument gives the number
+of contexts (default 8).  Exits with 1 if any differ.
+**********************************************************************/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pnmio.h"
+#include "klt.h"
+
+#define NFRAMES   3
+#define NROUNDS   4
+
+static unsigned char *img[NFRAMES];
+static int ncols, nrows;
+
+typedef struct  {
+  int id;
+  KLT_FeatureStore fs;
+}  Job;
+
+static void *run(
+  void *arg)
+{
+  Job *job = (Job *) arg;
+  KLT_TrackingContext tc;
+  int i, r;
+
+  /* Vary the options from context to context */
+  tc = KLTCreateTrackingContext();
+  tc->verbosity = 0;
+  tc->sequentialMode = TRUE;
+  tc->mindist = 8 + job->id % 4;
+  tc->fixedPoint = job->id & 1;
+  tc->nThreads = 1 + (job->id >> 1 & 1);
+  tc->adaptivePyramid = job->id >> 2 & 1;
+  tc->inverseCompositional = job->id % 3 == 0;
+  tc->replace_bands = 1 + job->id % 4;
+  tc->pyramidStorage = job->id % 3;
+  tc->detector = (job->id % 5 == 4) ? KLT_DETECT_HARRIS
+                                    : KLT_DETECT_MIN_EIGENVALUE;
+  tc->score = (job->id % 7 == 6) ? KLTHarrisScore : NULL;
+
+  for (r = 0 ; r < NROUNDS ; r++)  {
+    KLTSelectGoodFeatureStore(tc, img[0], ncols, nrows, job->fs);
+    for (i = 1 ; i < NFRAMES ; i++)  {
+      KLTTrackFeatureStore(tc, img[i-1], img[i], ncols, nrows,
+                           job->fs, NULL);
+      KLTReplaceLostFeatureStore(tc, img[i], ncols, nrows, job->fs);
+    }
+    KLTStopSequentialMode(tc);
+    tc->sequentialMode = TRUE;
+  }
+
+  KLTFreeTrackingContext(tc);
+  return NULL;
+}
+
+static int sameStore(
+  KLT_FeatureStore a,
+  KLT_FeatureStore b)
+{
+  int n = a->nFeatures;
+
+  return memcmp(a->x, b->x, n * sizeof(KLT_locType)) == 0 &&
+    memcmp(a->y, b->y, n * sizeof(KLT_locType)) == 0 &&
+    memcmp(a->val, b->val, n * sizeof(int)) == 0 &&
+    memcmp(a->vx, b->vx, n * sizeof(KLT_locType)) == 0 &&
+    memcmp(a->vy, b->vy, n * sizeof(KLT_locType)) == 0 &&
+    memcmp(a->age, b->age, n * sizeof(int)) == 0;
+}
+
+int main(int argc, char **argv)
+{
+  int ncontexts = (argc > 1) ? atoi(argv[1]) : 8;
+  int nFeatures = 150;
+  Job *serial, *parallel;
+  pthread_t *thread;
+  char fname[100];
+  int nbad = 0;
+  int i;
+
+  if (ncontexts < 1)  ncontexts = 1;
+  for (i = 0 ; i < NFRAMES ; i++)  {
+    sprintf(fname, "img%d.pgm", i);
+    img[i] = pgmReadFile(fname, NULL, &ncols, &nrows);
+  }
+
+  serial = (Job *) malloc(2 * ncontexts * sizeof(Job));
+  parallel = serial + ncontexts;
+  thread = (pthread_t *) malloc(ncontexts * sizeof(pthread_t));
+  for (i = 0 ; i < ncontexts ; i++)  {
+    serial[i].id = parallel[i].id = i;
+    serial[i].fs = KLTCreateFeatureStore(nFeatures, TRUE);
+    parallel[i].fs = KLTCreateFeatureStore(nFeatures, TRUE);
+  }
+
+  for (i = 0 ; i < ncontexts ; i++)
+    run(&serial[i]);
+
+  for (i = 0 ; i < ncontexts ; i++)
+    if (pthread_create(&thread[i], NULL, run, &parallel[i]) != 0)  {
+      fprintf(stderr, "Can't create thread %d\n", i);
+      return 1;
+    }
+  for (i = 0 ; i < ncontexts ; i++)
+    pthread_join(thread[i], NULL);
+
+  for (i = 0 ; i < ncontexts ; i++)  {
+    KLT_BOOL same = sameStore(serial[i].fs, parallel[i].fs);
+    printf("context %d:  %3d features, %s\n", i,
+           KLTCountRemainingFeatureStore(parallel[i].fs),
+           same ? "same as serial" : "DIFFERENT from serial");
+    if (!same)  nbad++;
+  }
+
+  return (nbad > 0) ? 1 : 0;
+}
@@ -0,0 +1,412 @@
+/*********************************************************************
+ * featureLog.c
+ *
+ * Feature logs:  binary files of a sequence of frames' features,
+ * written one frame at a time and read back by mapping the file into
+ * memory, so that neither side holds the whole sequence.
+ *
+ * The file is a header, then one block per frame, then an index.
+ * Each block is the frame number and its number of features, followed
+ * by the x, y and val columns, which a reader uses in place.  The
+ * index, which KLTCloseFeatureLog writes, gives the offset of each
+ * block; a file whose writer never closed it has no index, and is read
+ * by walking from block to block instead.  All numbers are in the
+ * writer's byte order, which the header records.
+ *********************************************************************/
+
+/* Standard includes */
+#include <assert.h>
+#include <fcntl.h>     /* open() */
+#include <stdint.h>
+#include <stdio.h>     /* fopen(), fwrite() */
+#include <stdlib.h>    /* malloc(), realloc() */
+#include <string.h>    /* memcmp() */
+#include <sys/mman.h>  /* mmap() */
+#include <sys/stat.h>  /* fstat() */
+#include <unistd.h>    /* close() */
+
+/* Our includes */
+#include "error.h"
+#include "klt.h"
+
+extern int KLT_verbose;
+
+#define LOG_VERSION	1
+#define LOG_BYTEORDER	0x01020304
+
+static const char log_magic[8] = "KLTFLOG";
+
+typedef struct  {
+  char magic[8];
+  int32_t version;
+  int32_t byteorder;		/* LOG_BYTEORDER, as the writer stored it */
+  int32_t nFrames;		/* zero until closed */
+  int32_t reserved;
+  int64_t index;		/* offset of the index, zero until closed */
+}  _LogHeader;
+
+typedef struct  {
+  int32_t frame;
+  int32_t nFeatures;
+  /* then x[nFeatures], y[nFeatures] and val[nFeatures] */
+}  _LogBlock;
+
+
+/*********************************************************************
+ * _blockSize
+ */
+
+static long _blockSize(
+  int nFeatures)
+{
+  return (long) sizeof(_LogBlock) +
+    (long) nFeatures * (2 * sizeof(KLT_locType) + sizeof(int));
+}
+
+
+/*********************************************************************
+ * _writeOrDie
+ */
+
+static void _writeOrDie(
+  const void *ptr,
+  size_t nbytes,
+  FILE *fp)
+{
+  if (nbytes > 0 && fwrite(ptr, nbytes, 1, fp) != 1)
+    KLTError("(_writeOrDie) Can't write to feature log");
+}
+
+
+/*********************************************************************
+ * KLTCreateFeatureLog
+ *
+ * Opens a feature log for writing, replacing any file of that name.
+ */
+
+KLT_FeatureLog KLTCreateFeatureLog(
+  char *fname)
+{
+  KLT_FeatureLog flog;
+  _LogHeader header;
+  FILE *fp;
+
+  /* The int column is stored like the float ones */
+  assert(sizeof(int) == sizeof(int32_t));
+  assert(sizeof(KLT_locType) == sizeof(int32_t));
+
+  fp = fopen(fname, "wb");
+  if (fp == NULL)
+    KLTError("(KLTCreateFeatureLog) Can't open file '%s' for writing", fname);
+  if (KLT_verbose >= 1)
+    fprintf(stderr, "(KLT) Writing feature log to '%s'\n", fname);
+
+  flog = (KLT_FeatureLog) malloc(sizeof(KLT_FeatureLogRec));
+  if (flog == NULL)
+    KLTError("(KLTCreateFeatureLog) Out of memory");
+
+  /* Write a header saying there is no index yet */
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, log_magic, sizeof(header.magic));
+  header.version = LOG_VERSION;
+  header.byteorder = LOG_BYTEORDER;
+  _writeOrDie(&header, sizeof(header), fp);
+
+  flog->nFrames = 0;
+  flog->fp = fp;
+  flog->offset = sizeof(header);
+  flog->index = NULL;
+  flog->index_size = 0;
+  flog->gather = NULL;
+  flog->gather_size = 0;
+
+  return flog;
+}
+
+
+/*********************************************************************
+ * _appendColumns
+ *
+ * Writes a frame's block and remembers where it went.
+ */
+
+static void _appendColumns(
+  KLT_FeatureLog flog,
+  int nFeatures,
+  const KLT_locType *x,
+  const KLT_locType *y,
+  const int *val)
+{
+  FILE *fp = (FILE *) flog->fp;
+  _LogBlock block;
+
+  if (flog->nFrames == flog->index_size)  {
+    int size = (flog->index_size > 0) ? 2 * flog->index_size : 1024;
+    int64_t *index = (int64_t *) realloc(flog->index, size * sizeof(int64_t));
+    if (index == NULL)
+      KLTError("(KLTAppendFeatureStore) Out of memory");
+    flog->index = index;
+    flog->index_size = size;
+  }
+  ((int64_t *) flog->index)[flog->nFrames] = flog->offset;
+
+  block.frame = flog->nFrames;
+  block.nFeatures = nFeatures;
+  _writeOrDie(&block, sizeof(block), fp);
+  _writeOrDie(x, nFeatures * sizeof(KLT_locType), fp);
+  _writeOrDie(y, nFeatures * sizeof(KLT_locType), fp);
+  _writeOrDie(val, nFeatures * sizeof(int), fp);
+
+  flog->offset += _blockSize(nFeatures);
+  flog->nFrames++;
+}
+
+
+/*********************************************************************
+ * KLTAppendFeatureStore
+ * KLTAppendFeatureList
+ *
+ * Adds the features of the next frame to the log.  Frames may have
+ * different numbers of features.
+ */
+
+void KLTAppendFeatureStore(
+  KLT_FeatureLog flog,
+  KLT_FeatureStore fs)
+{
+  _appendColumns(flog, fs->nFeatures, fs->x, fs->y, fs->val);
+}
+
+
+void KLTAppendFeatureList(
+  KLT_FeatureLog flog,
+  KLT_FeatureList fl)
+{
+  int n = fl->nFeatures;
+  KLT_locType *x, *y;
+  int *val;
+  int i;
+
+  /* Gather the list into columns first */
+  if (flog->gather_size < n)  {
+    free(flog->gather);
+    flog->gather = malloc(n * (2 * sizeof(KLT_locType) + sizeof(int)));
+    if (flog->gather == NULL)
+      KLTError("(KLTAppendFeatureList) Out of memory");
+    flog->gather_size = n;
+  }
+  x = (KLT_locType *) flog->gather;
+  y = x + n;
+  val = (int *) (y + n);
+
+  for (i = 0 ; i < n ; i++)  {
+    x[i] = fl->feature[i]->x;
+    y[i] = fl->feature[i]->y;
+    val[i] = fl->feature[i]->val;
+  }
+
+  _appendColumns(flog, n, x, y, val);
+}
+
+
+/*********************************************************************
+ * KLTCloseFeatureLog
+ *
+ * Writes the index, finishes the file and frees the log.
+ */
+
+void KLTCloseFeatureLog(
+  KLT_FeatureLog flog)
+{
+  FILE *fp = (FILE *) flog->fp;
+  static const char zeros[sizeof(int64_t)] = {0};
+  _LogHeader header;
+  long pad;
+
+  /* The index is aligned for reading in place */
+  pad = (sizeof(int64_t) - flog->offset % sizeof(int64_t)) % sizeof(int64_t);
+  _writeOrDie(zeros, pad, fp);
+  _writeOrDie(flog->index, flog->nFrames * sizeof(int64_t), fp);
+
+  /* Only now point the header at it */
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, log_magic, sizeof(header.magic));
+  header.version = LOG_VERSION;
+  header.byteorder = LOG_BYTEORDER;
+  header.nFrames = flog->nFrames;
+  header.index = flog->offset + pad;
+  if (fseek(fp, 0, SEEK_SET) != 0)
+    KLTError("(KLTCloseFeatureLog) Can't rewind feature log");
+  _writeOrDie(&header, sizeof(header), fp);
+
+  if (fclose(fp) != 0)
+    KLTError("(KLTCloseFeatureLog) Can't write to feature log");
+
+  free(flog->index);
+  free(flog->gather);
+  free(flog);
+}
+
+
+/*********************************************************************
+ * _walkBlocks
+ *
+ * Builds the index of a log whose writer did not close it, from the
+ * blocks that were written in full.
+ */
+
+static int64_t *_walkBlocks(
+  const char *map,
+  long size,
+  int *nFrames)
+{
+  int64_t *index = NULL;
+  int index_size = 0;
+  long offset = sizeof(_LogHeader);
+  int n = 0;
+
+  while (offset + (long) sizeof(_LogBlock) <= size)  {
+    const _LogBlock *block = (const _LogBlock *) (map + offset);
+
+    if (block->frame != n || block->nFeatures < 0 ||
+        _blockSize(block->nFeatures) > size - offset)
+      break;
+
+    if (n == index_size)  {
+      index_size = (index_size > 0) ? 2 * index_size : 1024;
+      index = (int64_t *) realloc(index, index_size * sizeof(int64_t));
+      if (index == NULL)
+        KLTError("(KLTMapFeatureLog) Out of memory");
+    }
+    index[n++] = offset;
+    offset += _blockSize(block->nFeatures);
+  }
+
+  *nFrames = n;
+  return index;
+}
+
+
+/*********************************************************************
+ * KLTMapFeatureLog
+ *
+ * Maps a feature log into memory for reading.  Nothing is read from it
+ * but the header (and, for a log that was never closed, the block
+ * headers) until frames are asked for.
+ */
+
+KLT_MappedFeatureLog KLTMapFeatureLog(
+  char *fname)
+{
+  KLT_MappedFeatureLog ml;
+  const _LogHeader *header;
+  struct stat st;
+  void *map;
+  long size;
+  int fd;
+
+  fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    KLTError("(KLTMapFeatureLog) Can't open file '%s' for reading", fname);
+  if (fstat(fd, &st) != 0)
+    KLTError("(KLTMapFeatureLog) Can't read file '%s'", fname);
+  size = (long) st.st_size;
+  if (size < (long) sizeof(_LogHeader))
+    KLTError("(KLTMapFeatureLog) File '%s' is not a feature log", fname);
+  if (KLT_verbose >= 1)
+    fprintf(stderr, "(KLT) Mapping feature log '%s'\n", fname);
+
+  map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    KLTError("(KLTMapFeatureLog) Can't map file '%s'", fname);
+
+  header = (const _LogHeader *) map;
+  if (memcmp(header->magic, log_magic, sizeof(header->magic)) != 0)
+    KLTError("(KLTMapFeatureLog) File '%s' is not a feature log", fname);
+  if (header->byteorder != LOG_BYTEORDER)
+    KLTError("(KLTMapFeatureLog) File '%s' was written on a machine "
+             "with a different byte order", fname);
+  if (header->version != LOG_VERSION)
+    KLTError("(KLTMapFeatureLog) File '%s' is version %d of the feature "
+             "log format; this reads version %d", fname,
+             header->version, LOG_VERSION);
+
+  ml = (KLT_MappedFeatureLog) malloc(sizeof(KLT_MappedFeatureLogRec));
+  if (ml == NULL)
+    KLTError("(KLTMapFeatureLog) Out of memory");
+  ml->map = map;
+  ml->size = size;
+
+  if (header->index != 0)  {
+    if (header->nFrames < 0 || header->index % sizeof(int64_t) != 0 ||
+        header->index > size ||
+        (size - header->index) / (long) sizeof(int64_t) < header->nFrames)
+      KLTError("(KLTMapFeatureLog) File '%s' is corrupted -- "
+               "bad index", fname);
+    ml->nFrames = header->nFrames;
+    ml->index = (const char *) map + header->index;
+    ml->own_index = FALSE;
+  } else  {
+    KLTWarning("(KLTMapFeatureLog) File '%s' was not closed; "
+               "reading the frames written in full", fname);
+    ml->index = _walkBlocks((const char *) map, size, &ml->nFrames);
+    ml->own_index = TRUE;
+  }
+
+  return ml;
+}
+
+
+/*********************************************************************
+ * KLTGetMappedFeatureStore
+ *
+ * Points fs at the features of a frame, in the mapped file:  fs must
+ * not be written to, nor freed with KLTFreeFeatureStore, and is valid
+ * until the log is unmapped.  It has no motion columns.
+ */
+
+void KLTGetMappedFeatureStore(
+  KLT_MappedFeatureLog ml,
+  int frame,
+  KLT_FeatureStore fs)
+{
+  const _LogBlock *block;
+  int64_t offset;
+
+  if (frame < 0 || frame >= ml->nFrames)
+    KLTError("(KLTGetMappedFeatureStore) Frame number %d is not between "
+             "0 and %d", frame, ml->nFrames - 1);
+
+  offset = ((const int64_t *) ml->index)[frame];
+  if (offset < (int64_t) sizeof(_LogHeader) ||
+      offset > ml->size - (long) sizeof(_LogBlock))
+    KLTError("(KLTGetMappedFeatureStore) Feature log is corrupted -- "
+             "bad offset for frame %d", frame);
+  block = (const _LogBlock *) ((const char *) ml->map + offset);
+  if (block->frame != frame || block->nFeatures < 0 ||
+      _blockSize(block->nFeatures) > ml->size - offset)
+    KLTError("(KLTGetMappedFeatureStore) Feature log is corrupted -- "
+             "bad block for frame %d", frame);
+
+  fs->nFeatures = block->nFeatures;
+  fs->x = (KLT_locType *) (block + 1);
+  fs->y = fs->x + fs->nFeatures;
+  fs->val = (int *) (fs->y + fs->nFeatures);
+  fs->vx = fs->vy = NULL;
+  fs->age = NULL;
+}
+
+
+/*********************************************************************
+ * KLTUnmapFeatureLog
+ */
+
+void KLTUnmapFeatureLog(
+  KLT_MappedFeatureLog ml)
+{
+  munmap(ml->map, ml->size);
+  if (ml->own_index)
+    free((void *) ml->index);
+  free(ml);
+}
@@ -32,9 +32,13 @@ http://www-leland.stanford.edu/group/OTL, (415) 723-0651.
 #include "error.h"
 #include "klt.h"
 #include "pyramid.h"
+#include "threads.h"
 
 
 static const int mindist = 10;
+static const int quota_per_cell = 0;
+static const int quota_cell_size = 64;
+static const int replace_bands = 1;
 static const int window_size = 7;
 static const int min_eigenvalue = 1;
 static const float min_determinant = 0.01;
@@ -44,11 +48,19 @@ static const float max_residue = 10.0;
 static const float grad_sigma = 1.0;
 static const float smooth_sigma_fact = 0.1;
 static const float pyramid_sigma_fact = 0.9;
+static const int iir_min_width = 31;
 static const KLT_BOOL sequentialMode = FALSE;
 static const KLT_BOOL smoothBeforeSelecting = TRUE;
 static const KLT_BOOL writeInternalImages = FALSE;
+static const KLT_BOOL fixedPoint = FALSE;
+static const int pyramidStorage = KLT_STORE_FLOAT;
+static const KLT_BOOL inverseCompositional = FALSE;
+static const KLT_BOOL adaptivePyramid = FALSE;
+static const int detector = KLT_DETECT_MIN_EIGENVALUE;
+static const int pyramid_hold_frames = 15;
 static const int search_range = 15;
 static const int nSkippedPixels = 0;
+static const int nThreads = 1;
 
 extern int KLT_verbose;
 
@@ -103,11 +115,22 @@ KLT_TrackingContext KLTCreateTrackingContext()
 
   /* Set values to default values */
   tc->mindist = mindist;
+  tc->quota_per_cell = quota_per_cell;
+  tc->quota_cell_size = quota_cell_size;
+  tc->replace_bands = replace_bands;
   tc->window_width = window_size;
   tc->window_height = window_size;
   tc->sequentialMode = sequentialMode;
   tc->smoothBeforeSelecting = smoothBeforeSelecting;
   tc->writeInternalImages = writeInternalImages;
+  tc->fixedPoint = fixedPoint;
+  tc->pyramidStorage = pyramidStorage;
+  tc->inverseCompositional = inverseCompositional;
+  tc->adaptivePyramid = adaptivePyramid;
+  tc->detector = detector;
+  tc->score = NULL;
+  tc->verbosity = KLT_verbose;
+  tc->pyramid_hold_frames = pyramid_hold_frames;
   tc->min_eigenvalue = min_eigenvalue;
   tc->min_determinant = min_determinant;
   tc->max_iterations = max_iterations;
@@ -116,10 +139,23 @@ KLT_TrackingContext KLTCreateTrackingContext()
   tc->grad_sigma = grad_sigma;
   tc->smooth_sigma_fact = smooth_sigma_fact;
   tc->pyramid_sigma_fact = pyramid_sigma_fact;
+  tc->iir_min_width = iir_min_width;
   tc->nSkippedPixels = nSkippedPixels;
+  tc->nThreads = nThreads;
+  tc->nTrackAttempted = 0;
+  tc->nTrackLost = 0;
+  tc->nTrackIterations = 0;
+  tc->nTrackLevels = 0;
   tc->pyramid_last = NULL;
   tc->pyramid_last_gradx = NULL;
   tc->pyramid_last_grady = NULL;
+  tc->kernel_cache = _KLTCreateKernelCache();
+  tc->thread_pool = NULL;
+  tc->pyramid_spare = NULL;
+  tc->scratch = NULL;
+  tc->pyramid_levels = 0;
+  tc->pyramid_calm_frames = 0;
+  tc->replace_band = 0;
 
   /* Change nPyramidLevels and subsampling */
   KLTChangeTCPyramid(tc, search_range);
@@ -164,6 +200,64 @@ KLT_FeatureList KLTCreateFeatureList(
 }
 
 
+/*********************************************************************
+ * KLTCreateFeatureStore
+ *
+ * The columns share one allocation with the record.  Every feature
+ * starts out lost, at (-1,-1).  With motion, the store also has
+ * velocity and age columns, starting at zero.
+ */
+
+KLT_FeatureStore KLTCreateFeatureStore(
+  int nFeatures,
+  KLT_BOOL motion)
+{
+  KLT_FeatureStore fs;
+  int ncolumns = (motion) ? 6 : 3;
+  int nbytes = sizeof(KLT_FeatureStoreRec) +
+    ncolumns * nFeatures * sizeof(KLT_locType);
+  int i;
+
+  /* The int columns are the same size as the float ones */
+  assert(sizeof(int) == sizeof(KLT_locType));
+
+  /* Allocate memory for feature store */
+  fs = (KLT_FeatureStore)  malloc(nbytes);
+  if (fs == NULL)
+    KLTError("(KLTCreateFeatureStore)  Out of memory");
+
+  /* Set parameters */
+  fs->nFeatures = nFeatures;
+
+  /* Set pointers */
+  fs->x = (KLT_locType *) (fs + 1);
+  fs->y = fs->x + nFeatures;
+  fs->val = (int *) (fs->y + nFeatures);
+  if (motion)  {
+    fs->vx = (KLT_locType *) (fs->val + nFeatures);
+    fs->vy = fs->vx + nFeatures;
+    fs->age = (int *) (fs->vy + nFeatures);
+  } else  {
+    fs->vx = fs->vy = NULL;
+    fs->age = NULL;
+  }
+
+  for (i = 0 ; i < nFeatures ; i++)  {
+    fs->x[i] = -1.0;
+    fs->y[i] = -1.0;
+    fs->val[i] = KLT_NOT_FOUND;
+  }
+  if (motion)
+    for (i = 0 ; i < nFeatures ; i++)  {
+      fs->vx[i] = fs->vy[i] = 0.0;
+      fs->age[i] = 0;
+    }
+
+  /* Return feature store */
+  return(fs);
+}
+
+
 /*********************************************************************
  * KLTCreateFeatureHistory
  *
@@ -239,6 +333,9 @@ void KLTPrintTrackingContext(
 {
   fprintf(stderr, "\n\nTracking context:\n\n");
   fprintf(stderr, "\tmindist = %d\n", tc->mindist);
+  fprintf(stderr, "\tquota_per_cell = %d\n", tc->quota_per_cell);
+  fprintf(stderr, "\tquota_cell_size = %d\n", tc->quota_cell_size);
+  fprintf(stderr, "\treplace_bands = %d\n", tc->replace_bands);
   fprintf(stderr, "\twindow_width = %d\n", tc->window_width);
   fprintf(stderr, "\twindow_height = %d\n", tc->window_height);
   fprintf(stderr, "\tsequentialMode = %s\n",
@@ -247,6 +344,22 @@ void KLTPrintTrackingContext(
           tc->smoothBeforeSelecting ? "TRUE" : "FALSE");
   fprintf(stderr, "\twriteInternalImages = %s\n",
           tc->writeInternalImages ? "TRUE" : "FALSE");
+  fprintf(stderr, "\tfixedPoint = %s\n",
+          tc->fixedPoint ? "TRUE" : "FALSE");
+  fprintf(stderr, "\tpyramidStorage = %s\n",
+          tc->pyramidStorage == KLT_STORE_HALF ? "HALF" :
+          tc->pyramidStorage == KLT_STORE_SHORT ? "SHORT" : "FLOAT");
+  fprintf(stderr, "\tinverseCompositional = %s\n",
+          tc->inverseCompositional ? "TRUE" : "FALSE");
+  fprintf(stderr, "\tadaptivePyramid = %s\n",
+          tc->adaptivePyramid ? "TRUE" : "FALSE");
+  fprintf(stderr, "\tdetector = %s\n",
+          tc->detector == KLT_DETECT_HARRIS ? "HARRIS" : "MIN_EIGENVALUE");
+  fprintf(stderr, "\tscore = %s\n",
+          tc->score == NULL ? "detector's own" :
+          tc->score == KLTMinEigenvalueScore ? "KLTMinEigenvalueScore" :
+          tc->score == KLTHarrisScore ? "KLTHarrisScore" : "user's");
+  fprintf(stderr, "\tverbosity = %d\n", tc->verbosity);
 
   fprintf(stderr, "\tmin_eigenvalue = %d\n", tc->min_eigenvalue);
   fprintf(stderr, "\tmin_determinant = %f\n", tc->min_determinant);
@@ -256,11 +369,14 @@ void KLTPrintTrackingContext(
   fprintf(stderr, "\tgrad_sigma = %f\n", tc->grad_sigma);
   fprintf(stderr, "\tsmooth_sigma_fact = %f\n", tc->smooth_sigma_fact);
   fprintf(stderr, "\tpyramid_sigma_fact = %f\n", tc->pyramid_sigma_fact);
+  fprintf(stderr, "\tiir_min_width = %d\n", tc->iir_min_width);
   fprintf(stderr, "\tnSkippedPixels = %d\n", tc->nSkippedPixels);
   fprintf(stderr, "\tborderx = %d\n", tc->borderx);
   fprintf(stderr, "\tbordery = %d\n", tc->bordery);
   fprintf(stderr, "\tnPyramidLevels = %d\n", tc->nPyramidLevels);
   fprintf(stderr, "\tsubsampling = %d\n", tc->subsampling);
+  fprintf(stderr, "\tpyramid_hold_frames = %d\n", tc->pyramid_hold_frames);
+  fprintf(stderr, "\tnThreads = %d\n", tc->nThreads);
 
   fprintf(stderr, "\n\tpyramid_last = %s\n", (tc->pyramid_last!=NULL) ?
           "points to old image" : "NULL");
@@ -392,13 +508,17 @@ void KLTUpdateTCBorder(
   window_hw = max(tc->window_width, tc->window_height)/2;
 
   /* Find widths of convolution windows */
-  _KLTGetKernelWidths(_KLTComputeSmoothSigma(tc),
+  _KLTGetKernelWidths(tc, _KLTComputeSmoothSigma(tc),
                       &gauss_width, &gaussderiv_width);
   smooth_gauss_hw = gauss_width/2;
-  _KLTGetKernelWidths(_pyramidSigma(tc),
+  _KLTGetKernelWidths(tc, _pyramidSigma(tc),
                       &gauss_width, &gaussderiv_width);
   pyramid_gauss_hw = gauss_width/2;
 
+  /* Also warm the kernel cache for the gradient sigma, so that none of */
+  /* the kernels need to be built while processing frames */
+  _KLTGetKernelWidths(tc, tc->grad_sigma, &gauss_width, &gaussderiv_width);
+
   /* Compute the # of invalid pixels at each level of the pyramid.
      n_invalid_pixels is computed with respect to the ith level   
      of the pyramid.  So, e.g., if n_invalid_pixels = 5 after   
@@ -441,6 +561,10 @@ void KLTFreeTrackingContext(
     _KLTFreePyramid((_KLT_Pyramid) tc->pyramid_last_gradx);
   if (tc->pyramid_last_grady)  
     _KLTFreePyramid((_KLT_Pyramid) tc->pyramid_last_grady);
+  _KLTFreeKernelCache(tc->kernel_cache);
+  _KLTFreeThreadPool(tc->thread_pool);
+  _KLTFreePyramidSpares(tc->pyramid_spare);
+  _KLTFreeScratch(tc->scratch);
   free(tc);
 }
 
@@ -450,6 +574,12 @@ void KLTFreeFeatureList(
   free(fl);
 }
 
+void KLTFreeFeatureStore(
+  KLT_FeatureStore fs)
+{
+  free(fs);
+}
+
 void KLTFreeFeatureHistory(
   KLT_FeatureHistory fh)
 {
@@ -498,8 +628,69 @@ int KLTCountRemainingFeatures(
   return count;
 }
 
+int KLTCountRemainingFeatureStore(
+  KLT_FeatureStore fs)
+{
+  int count = 0;
+  int i;
+
+  for (i = 0 ; i < fs->nFeatures ; i++)
+    if (fs->val[i] >= 0)
+      count++;
+
+  return count;
+}
+
+
+/*********************************************************************
+ * KLTCopyFeatureListToStore
+ * KLTCopyFeatureStoreToList
+ *
+ * Copy positions and vals between a feature list and a store of the
+ * same size.  A store's motion columns are left alone.
+ */
+
+void KLTCopyFeatureListToStore(
+  KLT_FeatureList fl,
+  KLT_FeatureStore fs)
+{
+  int i;
+
+  if (fl->nFeatures != fs->nFeatures)
+    KLTError("(KLTCopyFeatureListToStore) Feature list has %d features, "
+             "but the store has %d", fl->nFeatures, fs->nFeatures);
+
+  for (i = 0 ; i < fl->nFeatures ; i++)  {
+    fs->x[i] = fl->feature[i]->x;
+    fs->y[i] = fl->feature[i]->y;
+    fs->val[i] = fl->feature[i]->val;
+  }
+}
+
+void KLTCopyFeatureStoreToList(
+  KLT_FeatureStore fs,
+  KLT_FeatureList fl)
+{
+  int i;
+
+  if (fl->nFeatures != fs->nFeatures)
+    KLTError("(KLTCopyFeatureStoreToList) Feature store has %d features, "
+             "but the list has %d", fs->nFeatures, fl->nFeatures);
+
+  for (i = 0 ; i < fs->nFeatures ; i++)  {
+    fl->feature[i]->x = fs->x[i];
+    fl->feature[i]->y = fs->y[i];
+    fl->feature[i]->val = fs->val[i];
+  }
+}
+
 /*********************************************************************
  * KLTSetVerbosity
+ *
+ * Sets the verbosity of the routines that take no tracking context,
+ * and that of contexts created afterwards.  Each context then has its
+ * own, in tc->verbosity, so contexts on different threads can differ
+ * without touching anything shared.
  */
 
 void KLTSetVerbosity(
@@ -28,6 +28,26 @@ typedef unsigned char KLT_PixelType;
 #define KLT_OOB              -4
 #define KLT_LARGE_RESIDUE    -5
 
+/* How pyramid and gradient images are stored (tc->pyramidStorage) */
+#define KLT_STORE_FLOAT       0
+#define KLT_STORE_HALF        1	/* IEEE half-precision floats */
+#define KLT_STORE_SHORT       2	/* scaled 16-bit integers */
+
+/* How pixels are scored when selecting features (tc->detector) */
+#define KLT_DETECT_MIN_EIGENVALUE  0	/* Shi-Tomasi, on smoothed gradients */
+#define KLT_DETECT_HARRIS          1	/* Harris, on Sobel gradients of */
+					/* the image as given; cheaper */
+
+/* Scores n windows when selecting features (tc->score), in the units */
+/* of min_eigenvalue, from the sums over each window of the gradient */
+/* products gx*gx, gx*gy and gy*gy.  Higher scores are better. */
+typedef void (*KLT_ScoreFunc)(
+  const float *gxx,
+  const float *gxy,
+  const float *gyy,
+  int n,
+  float *val);
+
 /*******************
  * Structures
  */
@@ -35,6 +55,12 @@ typedef unsigned char KLT_PixelType;
 typedef struct  {
   /* Available to user */
   int mindist;			/* min distance b/w features */
+  int quota_per_cell;		/* if positive, the most features selection */
+  int quota_cell_size;		/* leaves in each square this many pixels */
+  /* across, for more even coverage; 0 for no limit */
+  int replace_bands;		/* if more than one, each call to */
+  /* KLTReplaceLostFeatures searches only the next of this many bands */
+  /* of rows, in turn, and only where there is room for features */
   int window_width, window_height;
   KLT_BOOL sequentialMode;	/* whether to save most recent image to save time */
   /* can set to TRUE manually, but don't set to */
@@ -42,6 +68,22 @@ typedef struct  {
   KLT_BOOL smoothBeforeSelecting;	/* whether to smooth image before */
   /* selecting features */
   KLT_BOOL writeInternalImages;	/* whether to write internal images */
+  KLT_BOOL fixedPoint;		/* whether to smooth and build pyramids */
+  /* in 16-bit fixed point rather than float */
+  int pyramidStorage;		/* KLT_STORE_FLOAT, KLT_STORE_HALF or */
+  /* KLT_STORE_SHORT, for the images kept for tracking */
+  KLT_BOOL inverseCompositional;	/* whether to track against a fixed */
+  /* template window, which is faster, rather than both images' windows */
+  KLT_BOOL adaptivePyramid;	/* whether to build only as many of the */
+  /* nPyramidLevels levels as the motion of recent frames needs */
+  int detector;			/* KLT_DETECT_MIN_EIGENVALUE or */
+  /* KLT_DETECT_HARRIS, for scoring pixels when selecting features, */
+  /* and for the gradients they are scored from */
+  KLT_ScoreFunc score;		/* if not NULL, scores the windows instead */
+  /* of the detector's own measure (KLTMinEigenvalueScore or */
+  /* KLTHarrisScore) */
+  int verbosity;		/* 0 for silence, 1 or more for messages */
+  /* from this context's routines; starts as set by KLTSetVerbosity */
   
   /* Available, but hopefully can ignore */
   int min_eigenvalue;		/* smallest eigenvalue allowed for selecting */
@@ -52,19 +94,51 @@ typedef struct  {
   float grad_sigma;
   float smooth_sigma_fact;
   float pyramid_sigma_fact;
+  int iir_min_width;		/* smoothing kernels at least this wide are */
+  /* applied recursively (IIR); 0 always uses the kernel */
   int nSkippedPixels;		/* # of pixels skipped when finding features */
   int borderx;			/* border in which features will not be found */
   int bordery;
   int nPyramidLevels;		/* computed from search_ranges */
   int subsampling;		/* 		" */
+  int pyramid_hold_frames;	/* with adaptivePyramid, # of frames that */
+  /* need fewer levels before one is dropped */
+  int nThreads;			/* # of threads for smoothing, pyramids, */
+  /* gradients and tracking; 1 does everything on the calling thread */
+
+  /* Set by each call to KLTTrackFeatures, for reporting */
+  int nTrackAttempted;		/* # of features it tried to track */
+  int nTrackLost;		/* # of those it lost */
+  int nTrackIterations;		/* iterations, over all features and levels */
+  int nTrackLevels;		/* # of pyramid levels it used */
   
   /* User must not touch these */
   void *pyramid_last;
   void *pyramid_last_gradx;
   void *pyramid_last_grady;
+  void *kernel_cache;		/* convolution kernels, by sigma */
+  void *thread_pool;		/* workers for nThreads > 1 */
+  void *pyramid_spare;		/* pyramids kept for reuse */
+  void *scratch;		/* buffers kept for reuse */
+  int pyramid_levels;		/* levels the next frame will use, with */
+  int pyramid_calm_frames;	/*   adaptivePyramid, and # of frames that */
+				/*   needed fewer */
+  int replace_band;		/* band the next replacement searches */
 }  KLT_TrackingContextRec, *KLT_TrackingContext;
 
 
+/* Where the pixels of an 8-bit image lie, for images that are not */
+/* tightly packed:  one channel of interleaved data, such as the luma */
+/* of YUYV (pixelStride 2), or a region of a larger image (data */
+/* pointing at its top-left pixel, and rowStride that of the whole). */
+/* Features found in a region have coordinates relative to it. */
+typedef struct  {
+  KLT_PixelType *data;		/* first pixel */
+  int ncols, nrows;
+  int rowStride;		/* bytes from each row to the next */
+  int pixelStride;		/* bytes from each pixel to the next */
+}  KLT_ImageRec, *KLT_Image;
+
 typedef struct  {
   KLT_locType x;
   KLT_locType y;
@@ -79,6 +153,18 @@ typedef struct  {
   KLT_Feature *feature;
 }  KLT_FeatureListRec, *KLT_FeatureList;
 
+/* The same features kept column by column, which is how the tracker */
+/* works on them.  vx, vy and age are NULL unless the store was */
+/* created with motion, in which case the tracker keeps them up to date. */
+typedef struct  {
+  int nFeatures;
+  KLT_locType *x;
+  KLT_locType *y;
+  int *val;
+  KLT_locType *vx, *vy;	/* displacement over the last frame tracked */
+  int *age;		/* # of frames tracked since selected */
+}  KLT_FeatureStoreRec, *KLT_FeatureStore;
+
 typedef struct  {
   int nFrames;
   KLT_Feature *feature;
@@ -90,6 +176,32 @@ typedef struct  {
   KLT_Feature **feature;
 }  KLT_FeatureTableRec, *KLT_FeatureTable;
 
+/* A file being written a frame at a time, holding each frame's */
+/* features column by column with an index of frames at the end, */
+/* so that long sequences need not be kept in memory */
+typedef struct  {
+  int nFrames;			/* # of frames written so far */
+
+  /* User must not touch these */
+  void *fp;
+  long offset;			/* where the next frame goes */
+  void *index;			/* where each frame went */
+  int index_size;
+  void *gather;			/* columns of a feature list being written */
+  int gather_size;
+}  KLT_FeatureLogRec, *KLT_FeatureLog;
+
+/* Such a file mapped into memory for reading, in place */
+typedef struct  {
+  int nFrames;
+
+  /* User must not touch these */
+  void *map;
+  long size;
+  const void *index;		/* in the map, or built if never closed */
+  KLT_BOOL own_index;
+}  KLT_MappedFeatureLogRec, *KLT_MappedFeatureLog;
+
 
 
 /*******************
@@ -100,6 +212,9 @@ typedef struct  {
 KLT_TrackingContext KLTCreateTrackingContext(void);
 KLT_FeatureList KLTCreateFeatureList(
   int nFeatures);
+KLT_FeatureStore KLTCreateFeatureStore(
+  int nFeatures,
+  KLT_BOOL motion);
 KLT_FeatureHistory KLTCreateFeatureHistory(
   int nFrames);
 KLT_FeatureTable KLTCreateFeatureTable(
@@ -111,6 +226,8 @@ void KLTFreeTrackingContext(
   KLT_TrackingContext tc);
 void KLTFreeFeatureList(
   KLT_FeatureList fl);
+void KLTFreeFeatureStore(
+  KLT_FeatureStore fs);
 void KLTFreeFeatureHistory(
   KLT_FeatureHistory fh);
 void KLTFreeFeatureTable(
@@ -130,16 +247,80 @@ void KLTTrackFeatures(
   int ncols,
   int nrows,
   KLT_FeatureList fl);
+void KLTTrackFeaturesPredicted(
+  KLT_TrackingContext tc,
+  KLT_PixelType *img1,
+  KLT_PixelType *img2,
+  int ncols,
+  int nrows,
+  KLT_FeatureList fl,
+  KLT_FeatureList predicted);
 void KLTReplaceLostFeatures(
   KLT_TrackingContext tc,
   KLT_PixelType *img,
   int ncols,
   int nrows,
   KLT_FeatureList fl);
+void KLTSelectGoodFeatureStore(
+  KLT_TrackingContext tc,
+  KLT_PixelType *img,
+  int ncols,
+  int nrows,
+  KLT_FeatureStore fs);
+void KLTTrackFeatureStore(
+  KLT_TrackingContext tc,
+  KLT_PixelType *img1,
+  KLT_PixelType *img2,
+  int ncols,
+  int nrows,
+  KLT_FeatureStore fs,
+  KLT_FeatureStore predicted);
+void KLTReplaceLostFeatureStore(
+  KLT_TrackingContext tc,
+  KLT_PixelType *img,
+  int ncols,
+  int nrows,
+  KLT_FeatureStore fs);
+void KLTSelectGoodFeatureStoreImage(
+  KLT_TrackingContext tc,
+  KLT_Image img,
+  KLT_FeatureStore fs);
+void KLTTrackFeatureStoreImage(
+  KLT_TrackingContext tc,
+  KLT_Image img1,
+  KLT_Image img2,
+  KLT_FeatureStore fs,
+  KLT_FeatureStore predicted);
+void KLTReplaceLostFeatureStoreImage(
+  KLT_TrackingContext tc,
+  KLT_Image img,
+  KLT_FeatureStore fs);
+
+/* Window scores, for tc->score */
+void KLTMinEigenvalueScore(
+  const float *gxx,
+  const float *gxy,
+  const float *gyy,
+  int n,
+  float *val);
+void KLTHarrisScore(
+  const float *gxx,
+  const float *gxy,
+  const float *gyy,
+  int n,
+  float *val);
 
 /* Utilities */
 int KLTCountRemainingFeatures(
   KLT_FeatureList fl);
+int KLTCountRemainingFeatureStore(
+  KLT_FeatureStore fs);
+void KLTCopyFeatureListToStore(
+  KLT_FeatureList fl,
+  KLT_FeatureStore fs);
+void KLTCopyFeatureStoreToList(
+  KLT_FeatureStore fs,
+  KLT_FeatureList fl);
 void KLTPrintTrackingContext(
   KLT_TrackingContext tc);
 void KLTChangeTCPyramid(
@@ -201,6 +382,26 @@ KLT_FeatureTable KLTReadFeatureTable(
   KLT_FeatureTable ft,
   char *filename);
 
+/* Logging a sequence of frames */
+KLT_FeatureLog KLTCreateFeatureLog(
+  char *filename);
+void KLTAppendFeatureStore(
+  KLT_FeatureLog flog,
+  KLT_FeatureStore fs);
+void KLTAppendFeatureList(
+  KLT_FeatureLog flog,
+  KLT_FeatureList fl);
+void KLTCloseFeatureLog(
+  KLT_FeatureLog flog);
+KLT_MappedFeatureLog KLTMapFeatureLog(
+  char *filename);
+void KLTGetMappedFeatureStore(
+  KLT_MappedFeatureLog ml,
+  int frame,
+  KLT_FeatureStore fs);
+void KLTUnmapFeatureLog(
+  KLT_MappedFeatureLog ml);
+
 
 #endif
 
@@ -6,6 +6,7 @@
 
 /* Standard includes */
 #include <assert.h>
+#include <math.h>    /* fabsf(), lrintf() */
 #include <stdlib.h>  /* malloc() */
 
 /* Our includes */
@@ -15,6 +16,17 @@
 #include "klt.h"
 #include "klt_util.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define CACHE_LINE  64
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define KLT_X86_F16C
+#endif
+
 
 /*********************************************************************/
 
@@ -25,6 +37,32 @@ float _KLTComputeSmoothSigma(
 }
 
 
+/*********************************************************************
+ * _KLTRowStride
+ *
+ * Returns the padded row stride, in floats, for an image ncols wide:
+ * a whole number of cache lines, and an odd one so that successive
+ * rows fall in different cache sets even when ncols is a power of two.
+ */
+
+static int _rowStride(
+  int ncols,
+  int size)			/* bytes per pixel */
+{
+  const int line = CACHE_LINE / size;
+  int nlines = (ncols + line - 1) / line;
+
+  if (nlines % 2 == 0)  nlines++;
+  return nlines * line;
+}
+
+int _KLTRowStride(
+  int ncols)
+{
+  return _rowStride(ncols, sizeof(float));
+}
+
+
 /*********************************************************************
  * _KLTCreateFloatImage
  */
@@ -34,21 +72,234 @@ _KLT_FloatImage _KLTCreateFloatImage(
   int nrows)
 {
   _KLT_FloatImage floatimg;
-  int recsz = (sizeof(_KLT_FloatImageRec) + 15) & ~15;
+  int recsz = (sizeof(_KLT_FloatImageRec) + CACHE_LINE-1) & ~(CACHE_LINE-1);
+  int stride = _KLTRowStride(ncols);
   int nbytes = recsz +
-    ncols * nrows * sizeof(float);
+    stride * nrows * sizeof(float);
 
-  /* make sure address is 16-byte aligned */
-  if (posix_memalign((void **)&floatimg, 16, nbytes))
+  /* make sure rows start on a cache line */
+  if (posix_memalign((void **)&floatimg, CACHE_LINE, nbytes))
     KLTError("(_KLTCreateFloatImage)  Out of memory");
   floatimg->ncols = ncols;
   floatimg->nrows = nrows;
+  floatimg->stride = stride;
   floatimg->data = (float *)  ((char *)floatimg + recsz);
+  floatimg->storage = KLT_STORE_FLOAT;
+  floatimg->scale = 1.0;
+  floatimg->data16 = NULL;
 
   return(floatimg);
 }
 
 
+/*********************************************************************
+ * _KLTCreatePackedImage
+ *
+ * Creates an image that keeps its pixels in 16 bits, as half floats
+ * (KLT_STORE_HALF) or scaled shorts (KLT_STORE_SHORT).  It is filled
+ * by _KLTPackImage() and freed with _KLTFreeFloatImage().
+ */
+
+_KLT_FloatImage _KLTCreatePackedImage(
+  int ncols,
+  int nrows,
+  int storage)
+{
+  _KLT_FloatImage floatimg;
+  int recsz = (sizeof(_KLT_FloatImageRec) + CACHE_LINE-1) & ~(CACHE_LINE-1);
+  int stride = _rowStride(ncols, sizeof(unsigned short));
+  int nbytes = recsz +
+    stride * nrows * sizeof(unsigned short);
+
+  if (storage != KLT_STORE_HALF && storage != KLT_STORE_SHORT)
+    KLTError("(_KLTCreatePackedImage)  Unknown storage %d", storage);
+
+  if (posix_memalign((void **)&floatimg, CACHE_LINE, nbytes))
+    KLTError("(_KLTCreatePackedImage)  Out of memory");
+  floatimg->ncols = ncols;
+  floatimg->nrows = nrows;
+  floatimg->stride = stride;
+  floatimg->data = NULL;
+  floatimg->storage = storage;
+  floatimg->scale = 1.0;
+  floatimg->data16 = (unsigned short *)  ((char *)floatimg + recsz);
+
+  return(floatimg);
+}
+
+
+/*********************************************************************
+ * _KLTPackImage
+ * _KLTUnpackImage
+ *
+ * Convert between a float image and one stored in 16 bits.  Halves
+ * are rounded to nearest even, by F16C where the CPU has it and by
+ * the same rounding in software otherwise.  Shorts are scaled so that
+ * the largest magnitude in the image becomes 32767.
+ */
+
+static unsigned short _floatToHalf(
+  float f)
+{
+  union { unsigned int u; float f; } v;
+  unsigned int sign, h;
+
+  v.f = f;
+  sign = (v.u >> 16) & 0x8000;
+  v.u &= 0x7fffffff;
+
+  if (v.u >= 0x47800000)  {		/* too big, Inf or NaN */
+    h = (v.u > 0x7f800000) ? 0x7e00 : 0x7c00;
+  } else if (v.u < 0x38800000)  {	/* subnormal or zero */
+    /* Adding 0.5 lines the half's mantissa up with the float's, and */
+    /* the addition rounds to nearest even */
+    union { unsigned int u; float f; } half;
+    half.u = 126 << 23;
+    v.f += half.f;
+    h = v.u - half.u;
+  } else  {
+    unsigned int odd = (v.u >> 13) & 1;
+    v.u += ((unsigned int) (15 - 127) << 23) + 0xfff + odd;
+    h = v.u >> 13;
+  }
+
+  return (unsigned short) (h | sign);
+}
+
+static float _rowMaxAbs(
+  const float *in,
+  int n,
+  float maxabs)
+{
+  int i = 0;
+
+#ifdef __SSE2__
+  if (n >= 4)  {
+    const __m128 nosign = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 m = _mm_set1_ps(maxabs);
+    float lanes[4];
+
+    for ( ; i + 4 <= n ; i += 4)
+      m = _mm_max_ps(m, _mm_and_ps(_mm_loadu_ps(in + i), nosign));
+    _mm_storeu_ps(lanes, m);
+    maxabs = max(max(lanes[0], lanes[1]), max(lanes[2], lanes[3]));
+  }
+#endif
+  for ( ; i < n ; i++)
+    if (fabsf(in[i]) > maxabs)  maxabs = fabsf(in[i]);
+
+  return maxabs;
+}
+
+static void _packShortRow(
+  const float *in,
+  int n,
+  float inv,
+  short *out)
+{
+  int i = 0;
+
+#ifdef __SSE2__
+  /* Rounds as lrintf() does, in the current rounding mode */
+  const __m128 vinv = _mm_set1_ps(inv);
+  const __m128i lowest = _mm_set1_epi16(-32767);
+
+  for ( ; i + 8 <= n ; i += 8)  {
+    __m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i), vinv));
+    __m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i + 4), vinv));
+    _mm_storeu_si128((__m128i *) (out + i),
+                     _mm_max_epi16(_mm_packs_epi32(a, b), lowest));
+  }
+#endif
+  for ( ; i < n ; i++)  {
+    long v = lrintf(in[i] * inv);
+    out[i] = (short) max(-32767, min(32767, v));
+  }
+}
+
+#ifdef KLT_X86_F16C
+__attribute__((target("f16c,avx")))
+static void _packHalfRowF16C(
+  const float *in,
+  int n,
+  unsigned short *out)
+{
+  int i;
+
+  for (i = 0 ; i + 8 <= n ; i += 8)
+    _mm_storeu_si128((__m128i *) (out + i),
+                     _mm256_cvtps_ph(_mm256_loadu_ps(in + i),
+                                     _MM_FROUND_TO_NEAREST_INT));
+  for ( ; i < n ; i++)  out[i] = _floatToHalf(in[i]);
+}
+#endif
+
+void _KLTPackImage(
+  _KLT_FloatImage img,
+  _KLT_FloatImage packed)
+{
+  int ncols = img->ncols, nrows = img->nrows;
+  int i, j;
+
+  assert(img->storage == KLT_STORE_FLOAT);
+  assert(packed->ncols == ncols && packed->nrows == nrows);
+
+  if (packed->storage == KLT_STORE_HALF)  {
+#ifdef KLT_X86_F16C
+    KLT_BOOL f16c = __builtin_cpu_supports("f16c") &&
+      __builtin_cpu_supports("avx");
+#endif
+    for (j = 0 ; j < nrows ; j++)  {
+      const float *in = img->data + j*img->stride;
+      unsigned short *out = packed->data16 + j*packed->stride;
+#ifdef KLT_X86_F16C
+      if (f16c)  {
+        _packHalfRowF16C(in, ncols, out);
+        continue;
+      }
+#endif
+      for (i = 0 ; i < ncols ; i++)  out[i] = _floatToHalf(in[i]);
+    }
+  } else  {
+    float maxabs = 0.0, inv;
+
+    assert(packed->storage == KLT_STORE_SHORT);
+    for (j = 0 ; j < nrows ; j++)
+      maxabs = _rowMaxAbs(img->data + j*img->stride, ncols, maxabs);
+    packed->scale = (maxabs > 0.0) ? maxabs / 32767.0f : 1.0f;
+    inv = 1.0f / packed->scale;
+
+    for (j = 0 ; j < nrows ; j++)
+      _packShortRow(img->data + j*img->stride, ncols, inv,
+                    (short *) (packed->data16 + j*packed->stride));
+  }
+}
+
+void _KLTUnpackImage(
+  _KLT_FloatImage packed,
+  _KLT_FloatImage img)
+{
+  int ncols = packed->ncols, nrows = packed->nrows;
+  int i, j;
+
+  assert(img->storage == KLT_STORE_FLOAT);
+  assert(img->ncols >= ncols && img->nrows >= nrows);
+
+  for (j = 0 ; j < nrows ; j++)  {
+    const unsigned short *in = packed->data16 + j*packed->stride;
+    float *out = img->data + j*img->stride;
+    if (packed->storage == KLT_STORE_HALF)
+      for (i = 0 ; i < ncols ; i++)  out[i] = _KLTHalfToFloat(in[i]);
+    else if (packed->storage == KLT_STORE_SHORT)
+      for (i = 0 ; i < ncols ; i++)
+        out[i] = ((const short *) in)[i] * packed->scale;
+    else
+      for (i = 0 ; i < ncols ; i++)
+        out[i] = packed->data[j*packed->stride + i];
+  }
+}
+
+
 /*********************************************************************
  * _KLTFreeFloatImage
  */
@@ -60,6 +311,206 @@ void _KLTFreeFloatImage(
 }
 
 
+/*********************************************************************
+ * _KLTCreateShortImage
+ */
+
+_KLT_ShortImage _KLTCreateShortImage(
+  int ncols,
+  int nrows)
+{
+  _KLT_ShortImage shortimg;
+  int recsz = (sizeof(_KLT_ShortImageRec) + 15) & ~15;
+  int nbytes = recsz +
+    ncols * nrows * sizeof(short);
+
+  if (posix_memalign((void **)&shortimg, 16, nbytes))
+    KLTError("(_KLTCreateShortImage)  Out of memory");
+  shortimg->ncols = ncols;
+  shortimg->nrows = nrows;
+  shortimg->data = (short *)  ((char *)shortimg + recsz);
+
+  return(shortimg);
+}
+
+
+/*********************************************************************
+ * _KLTFreeShortImage
+ */
+
+void _KLTFreeShortImage(
+  _KLT_ShortImage shortimg)
+{
+  free(shortimg);
+}
+
+
+/*********************************************************************
+ * _KLTPackedImage
+ *
+ * Describes ncols by nrows pixels packed one after another, as the
+ * entry points that take a plain pixel pointer expect.
+ */
+
+void _KLTPackedImage(
+  KLT_PixelType *data,
+  int ncols,
+  int nrows,
+  KLT_Image img)
+{
+  img->data = data;
+  img->ncols = ncols;
+  img->nrows = nrows;
+  img->rowStride = ncols;
+  img->pixelStride = 1;
+}
+
+
+/*********************************************************************
+ * _KLTImageRow
+ *
+ * Row j of an image as packed pixels:  in place if they already are,
+ * otherwise gathered into buf, which must hold img->ncols pixels.
+ */
+
+const KLT_PixelType *_KLTImageRow(
+  KLT_Image img,
+  int j,
+  KLT_PixelType *buf)
+{
+  const KLT_PixelType *in = img->data + (size_t) j * img->rowStride;
+  int step = img->pixelStride;
+  int i;
+
+  if (step == 1)  return in;
+
+  for (i = 0 ; i < img->ncols ; i++, in += step)
+    buf[i] = *in;
+  return buf;
+}
+
+
+/*********************************************************************
+ * _KLTGetScratch
+ * _KLTGetScratchFloatImage
+ * _KLTGetScratchShortImage
+ * _KLTGetScratchFeatureStore
+ * _KLTFreeScratch
+ *
+ * Scratch buffers owned by the tracking context.  Each slot keeps the
+ * largest buffer asked of it so far, aligned to a cache line, so once
+ * the frame size settles no more memory is allocated.  The contents
+ * do not survive a call that has to grow the buffer.
+ */
+
+typedef struct  {
+  void *data;
+  size_t nbytes;
+  _KLT_FloatImageRec floatimg;
+  _KLT_ShortImageRec shortimg;
+  KLT_FeatureStoreRec store;
+}  _KLT_ScratchRec;
+
+void *_KLTGetScratch(
+  KLT_TrackingContext tc,
+  _KLT_ScratchSlot slot,
+  size_t nbytes)
+{
+  _KLT_ScratchRec *scratch = (_KLT_ScratchRec *) tc->scratch;
+
+  assert(slot >= 0 && slot < _KLT_NSCRATCH);
+
+  if (scratch == NULL)  {
+    scratch = (_KLT_ScratchRec *) calloc(_KLT_NSCRATCH, sizeof(*scratch));
+    if (scratch == NULL)
+      KLTError("(_KLTGetScratch)  Out of memory");
+    tc->scratch = scratch;
+  }
+  scratch += slot;
+
+  if (scratch->nbytes < nbytes)  {
+    free(scratch->data);
+    if (posix_memalign(&scratch->data, CACHE_LINE, nbytes))
+      KLTError("(_KLTGetScratch)  Out of memory");
+    scratch->nbytes = nbytes;
+  }
+
+  return scratch->data;
+}
+
+_KLT_FloatImage _KLTGetScratchFloatImage(
+  KLT_TrackingContext tc,
+  _KLT_ScratchSlot slot,
+  int ncols,
+  int nrows)
+{
+  int stride = _KLTRowStride(ncols);
+  float *data = (float *) _KLTGetScratch(tc, slot,
+                                         stride * nrows * sizeof(float));
+  _KLT_FloatImage floatimg = &((_KLT_ScratchRec *) tc->scratch)[slot].floatimg;
+
+  floatimg->ncols = ncols;
+  floatimg->nrows = nrows;
+  floatimg->stride = stride;
+  floatimg->data = data;
+  floatimg->storage = KLT_STORE_FLOAT;
+  floatimg->scale = 1.0;
+  floatimg->data16 = NULL;
+
+  return floatimg;
+}
+
+_KLT_ShortImage _KLTGetScratchShortImage(
+  KLT_TrackingContext tc,
+  _KLT_ScratchSlot slot,
+  int ncols,
+  int nrows)
+{
+  short *data = (short *) _KLTGetScratch(tc, slot,
+                                         ncols * nrows * sizeof(short));
+  _KLT_ShortImage shortimg = &((_KLT_ScratchRec *) tc->scratch)[slot].shortimg;
+
+  shortimg->ncols = ncols;
+  shortimg->nrows = nrows;
+  shortimg->data = data;
+
+  return shortimg;
+}
+
+/* A store without motion columns, its contents undefined */
+KLT_FeatureStore _KLTGetScratchFeatureStore(
+  KLT_TrackingContext tc,
+  _KLT_ScratchSlot slot,
+  int nFeatures)
+{
+  KLT_locType *data = (KLT_locType *) _KLTGetScratch(tc, slot,
+                                  3 * nFeatures * sizeof(KLT_locType));
+  KLT_FeatureStore fs = &((_KLT_ScratchRec *) tc->scratch)[slot].store;
+
+  fs->nFeatures = nFeatures;
+  fs->x = data;
+  fs->y = data + nFeatures;
+  fs->val = (int *) (data + 2*nFeatures);
+  fs->vx = fs->vy = NULL;
+  fs->age = NULL;
+
+  return fs;
+}
+
+void _KLTFreeScratch(
+  void *p)
+{
+  _KLT_ScratchRec *scratch = (_KLT_ScratchRec *) p;
+  int i;
+
+  if (scratch == NULL)  return;
+
+  for (i = 0 ; i < _KLT_NSCRATCH ; i++)
+    free(scratch[i].data);
+  free(scratch);
+}
+
+
 /*********************************************************************
  * _KLTPrintSubFloatImage
  */
@@ -69,19 +520,19 @@ void _KLTPrintSubFloatImage(
   int x0, int y0,
   int width, int height)
 {
-  int ncols = floatimg->ncols;
+  int stride = floatimg->stride;
   int offset;
   int i, j;
 
   assert(x0 >= 0);
   assert(y0 >= 0);
-  assert(x0 + width <= ncols);
+  assert(x0 + width <= floatimg->ncols);
   assert(y0 + height <= floatimg->nrows);
 
   fprintf(stderr, "\n");
   for (j = 0 ; j < height ; j++)  {
     for (i = 0 ; i < width ; i++)  {
-      offset = (j+y0)*ncols + (i+x0);
+      offset = (j+y0)*stride + (i+x0);
       fprintf(stderr, "%6.2f ", *(floatimg->data + offset));
     }
     fprintf(stderr, "\n");
@@ -103,14 +554,25 @@ void _KLTWriteFloatImageToPGM(
   float fact;
   float *ptr;
   uchar *byteimg, *ptrout;
-  int i;
+  int i, j;
+
+  /* Widen images stored in 16 bits first */
+  if (img->storage != KLT_STORE_FLOAT)  {
+    _KLT_FloatImage floatimg = _KLTCreateFloatImage(img->ncols, img->nrows);
+    _KLTUnpackImage(img, floatimg);
+    _KLTWriteFloatImageToPGM(floatimg, filename);
+    _KLTFreeFloatImage(floatimg);
+    return;
+  }
 
   /* Calculate minimum and maximum values of float image */
-  ptr = img->data;
-  for (i = 0 ; i < npixs ; i++)  {
-    mmax = max(mmax, *ptr);
-    mmin = min(mmin, *ptr);
-    ptr++;
+  for (j = 0 ; j < img->nrows ; j++)  {
+    ptr = img->data + j*img->stride;
+    for (i = 0 ; i < img->ncols ; i++)  {
+      mmax = max(mmax, *ptr);
+      mmin = min(mmin, *ptr);
+      ptr++;
+    }
   }
 	
   /* Allocate memory to hold converted image */
@@ -118,10 +580,11 @@ void _KLTWriteFloatImageToPGM(
 
   /* Convert image from float to uchar */
   fact = 255.0 / (mmax-mmin);
-  ptr = img->data;
   ptrout = byteimg;
-  for (i = 0 ; i < npixs ; i++)  {
-    *ptrout++ = (uchar) ((*ptr++ - mmin) * fact);
+  for (j = 0 ; j < img->nrows ; j++)  {
+    ptr = img->data + j*img->stride;
+    for (i = 0 ; i < img->ncols ; i++)
+      *ptrout++ = (uchar) ((*ptr++ - mmin) * fact);
   }
 
   /* Write uchar image to PGM */
@@ -5,19 +5,144 @@
 #ifndef _KLT_UTIL_H_
 #define _KLT_UTIL_H_
 
+#include <stddef.h>	/* size_t */
+#include "klt.h"
+
+/* Rows of a float image are stride floats apart.  The stride is padded
+   to an odd number of cache lines, so that walking down a column does
+   not keep hitting the same cache sets.  Pyramid and gradient images
+   may instead keep their pixels in 16 bits (storage is then
+   KLT_STORE_HALF or KLT_STORE_SHORT; see the tracking context's
+   pyramidStorage):  data is NULL, and data16 holds half floats, or
+   shorts to be multiplied by scale, with rows stride elements apart. */
 typedef struct  {
   int ncols;
   int nrows;
+  int stride;
   float *data;
+  int storage;
+  float scale;
+  unsigned short *data16;
 }  _KLT_FloatImageRec, *_KLT_FloatImage;
 
+/* Fixed-point image, used by the tracking context's fixedPoint mode.
+   Pixels are stored scaled by 2^_KLT_FIXED_SHIFT. */
+#define _KLT_FIXED_SHIFT  7
+
+typedef struct  {
+  int ncols;
+  int nrows;
+  short *data;
+}  _KLT_ShortImageRec, *_KLT_ShortImage;
+
+int _KLTRowStride(
+  int ncols);
+
 _KLT_FloatImage _KLTCreateFloatImage(
   int ncols, 
   int nrows);
 
 void _KLTFreeFloatImage(
   _KLT_FloatImage);
+
+_KLT_FloatImage _KLTCreatePackedImage(
+  int ncols, 
+  int nrows,
+  int storage);
+
+void _KLTPackImage(
+  _KLT_FloatImage img,
+  _KLT_FloatImage packed);
+
+void _KLTUnpackImage(
+  _KLT_FloatImage packed,
+  _KLT_FloatImage img);
+
+/* Widens one half-precision float */
+static inline float _KLTHalfToFloat(
+  unsigned short h)
+{
+  union { unsigned int u; float f; } v;
+
+  /* Shift exponent and mantissa into place and rebias the exponent by */
+  /* multiplying by 2^112, which also normalizes subnormals */
+  v.u = (unsigned int) (h & 0x7fff) << 13;
+  v.f *= 5.192296858534828e+33f;
+  if ((h & 0x7fff) >= 0x7c00)  v.u |= 0xff << 23;	/* Inf or NaN */
+  v.u |= (unsigned int) (h & 0x8000) << 16;
+  return v.f;
+}
 	
+_KLT_ShortImage _KLTCreateShortImage(
+  int ncols, 
+  int nrows);
+
+void _KLTFreeShortImage(
+  _KLT_ShortImage);
+
+void _KLTPackedImage(
+  KLT_PixelType *data,
+  int ncols,
+  int nrows,
+  KLT_Image img);
+
+const KLT_PixelType *_KLTImageRow(
+  KLT_Image img,
+  int j,
+  KLT_PixelType *buf);
+
+/* Scratch buffers kept by the tracking context from one call to the
+   next, one per use.  Code using a slot must not call anything that
+   uses the same slot while it still needs the buffer. */
+typedef enum  {
+  _KLT_SCRATCH_INPUT,		/* incoming frame as floats */
+  _KLT_SCRATCH_INPUT_FIXED,	/* incoming frame in fixed point */
+  _KLT_SCRATCH_PYRAMID_FIXED,	/* fixed-point pyramid levels (two) */
+  _KLT_SCRATCH_PYRAMID_FIXED2,
+  _KLT_SCRATCH_SELECT_IMG,	/* feature selection's smoothed image */
+  _KLT_SCRATCH_SELECT_GRADX,	/*  and its gradients */
+  _KLT_SCRATCH_SELECT_GRADY,
+  _KLT_SCRATCH_SELECT_SUMS,	/*  and its window sums */
+  _KLT_SCRATCH_CANDIDATES,	/*  and its best candidates (two) */
+  _KLT_SCRATCH_CANDIDATES2,
+  _KLT_SCRATCH_OCCUPANCY,	/*  and where it has put features */
+  _KLT_SCRATCH_PACK_GRADX,	/* gradients of a level, before packing */
+  _KLT_SCRATCH_PACK_GRADY,
+  _KLT_SCRATCH_WINDOWS,		/* tracking windows */
+  _KLT_SCRATCH_TRACK_STATE,	/* per-feature state between levels */
+  _KLT_SCRATCH_MOTION,		/* displacements, for adaptivePyramid */
+  _KLT_SCRATCH_FEATURES,	/* feature lists copied into stores */
+  _KLT_SCRATCH_PREDICTED,
+  _KLT_SCRATCH_CONVOLVE,	/* per-band convolution buffers */
+  _KLT_SCRATCH_CONVOLVE_IMAGE,	/* whole-image convolution temporary */
+  _KLT_NSCRATCH
+}  _KLT_ScratchSlot;
+
+void *_KLTGetScratch(
+  KLT_TrackingContext tc,
+  _KLT_ScratchSlot slot,
+  size_t nbytes);
+
+_KLT_FloatImage _KLTGetScratchFloatImage(
+  KLT_TrackingContext tc,
+  _KLT_ScratchSlot slot,
+  int ncols, 
+  int nrows);
+
+_KLT_ShortImage _KLTGetScratchShortImage(
+  KLT_TrackingContext tc,
+  _KLT_ScratchSlot slot,
+  int ncols, 
+  int nrows);
+
+KLT_FeatureStore _KLTGetScratchFeatureStore(
+  KLT_TrackingContext tc,
+  _KLT_ScratchSlot slot,
+  int nFeatures);
+
+void _KLTFreeScratch(
+  void *scratch);
+
 void _KLTPrintSubFloatImage(
   _KLT_FloatImage floatimg,
   int x0, int y0,
@@ -24,7 +24,8 @@ _KLT_Pyramid _KLTCreatePyramid(
   int ncols,
   int nrows,
   int subsampling,
-  int nlevels)
+  int nlevels,
+  int storage)			/* KLT_STORE_*, for the level images */
 {
   _KLT_Pyramid pyramid;
   int nbytes = sizeof(_KLT_PyramidRec) +	
@@ -53,7 +54,10 @@ _KLT_Pyramid _KLTCreatePyramid(
 
   /* Allocate memory for each level of pyramid and assign pointers */
   for (i = 0 ; i < nlevels ; i++)  {
-    pyramid->img[i] =  _KLTCreateFloatImage(ncols, nrows);
+    if (storage == KLT_STORE_FLOAT)
+      pyramid->img[i] =  _KLTCreateFloatImage(ncols, nrows);
+    else
+      pyramid->img[i] =  _KLTCreatePackedImage(ncols, nrows, storage);
     pyramid->ncols[i] = ncols;  pyramid->nrows[i] = nrows;
     ncols /= subsampling;  nrows /= subsampling;
   }
@@ -81,15 +85,183 @@ void _KLTFreePyramid(
 
 
 /*********************************************************************
+ * _KLTGetPyramid
+ * _KLTReleasePyramid
+ * _KLTFreePyramidSpares
+ *
+ * The tracking context keeps the pyramids it has finished with, up to
+ * the six that tracking between two frames needs and the one used to
+ * build pyramids stored in 16 bits, and hands them out again in place
+ * of new ones of the same size.  In sequential mode the
+ * pyramids of the previous frame are released as those of the new
+ * frame are kept, so the two sets simply swap roles from frame to
+ * frame.
+ */
+
+#define MAX_SPARE_PYRAMIDS  7
+
+typedef struct  {
+  int n;
+  _KLT_Pyramid pyramid[MAX_SPARE_PYRAMIDS];
+}  _KLT_PyramidSpares;
+
+_KLT_Pyramid _KLTGetPyramid(
+  KLT_TrackingContext tc,
+  int ncols,
+  int nrows,
+  int subsampling,
+  int nlevels,
+  int storage)
+{
+  _KLT_PyramidSpares *spares = (_KLT_PyramidSpares *) tc->pyramid_spare;
+  _KLT_Pyramid pyramid;
+  int i;
+
+  if (spares != NULL)
+    for (i = spares->n - 1 ; i >= 0 ; i--)  {
+      pyramid = spares->pyramid[i];
+      if (pyramid->ncols[0] == ncols && pyramid->nrows[0] == nrows &&
+          pyramid->subsampling == subsampling && pyramid->nLevels == nlevels &&
+          pyramid->img[0]->storage == storage)  {
+        spares->n--;
+        memmove(spares->pyramid + i, spares->pyramid + i + 1,
+                (spares->n - i) * sizeof(_KLT_Pyramid));
+        return pyramid;
+      }
+    }
+
+  return _KLTCreatePyramid(ncols, nrows, subsampling, nlevels, storage);
+}
+
+void _KLTReleasePyramid(
+  KLT_TrackingContext tc,
+  _KLT_Pyramid pyramid)
+{
+  _KLT_PyramidSpares *spares = (_KLT_PyramidSpares *) tc->pyramid_spare;
+
+  if (spares == NULL)  {
+    spares = (_KLT_PyramidSpares *) malloc(sizeof(_KLT_PyramidSpares));
+    if (spares == NULL)
+      KLTError("(_KLTReleasePyramid)  Out of memory");
+    spares->n = 0;
+    tc->pyramid_spare = spares;
+  }
+
+  /* When full, drop the oldest, which is the least likely to fit */
+  if (spares->n == MAX_SPARE_PYRAMIDS)  {
+    _KLTFreePyramid(spares->pyramid[0]);
+    memmove(spares->pyramid, spares->pyramid + 1,
+            (MAX_SPARE_PYRAMIDS-1) * sizeof(_KLT_Pyramid));
+    spares->n--;
+  }
+  spares->pyramid[spares->n++] = pyramid;
+}
+
+void _KLTFreePyramidSpares(
+  void *p)
+{
+  _KLT_PyramidSpares *spares = (_KLT_PyramidSpares *) p;
+  int i;
+
+  if (spares == NULL)  return;
+
+  for (i = 0 ; i < spares->n ; i++)
+    _KLTFreePyramid(spares->pyramid[i]);
+  free(spares);
+}
+
+
+/*********************************************************************
+ * _KLTGrowPyramid
  *
+ * Returns a pyramid of nlevels levels whose first levels are those of
+ * the given one, which is released.  The levels added are left for
+ * the caller to compute.
+ */
+
+_KLT_Pyramid _KLTGrowPyramid(
+  KLT_TrackingContext tc,
+  _KLT_Pyramid pyramid,
+  int nlevels)
+{
+  _KLT_Pyramid grown;
+  _KLT_FloatImage tmp;
+  int i;
+
+  assert(nlevels >= pyramid->nLevels);
+
+  grown = _KLTGetPyramid(tc, pyramid->ncols[0], pyramid->nrows[0],
+                         pyramid->subsampling, nlevels,
+                         pyramid->img[0]->storage);
+
+  /* Swap rather than copy the levels, so both pyramids stay whole */
+  for (i = 0 ; i < pyramid->nLevels ; i++)  {
+    tmp = grown->img[i];
+    grown->img[i] = pyramid->img[i];
+    pyramid->img[i] = tmp;
+  }
+  _KLTReleasePyramid(tc, pyramid);
+
+  return grown;
+}
+
+
+/*********************************************************************
+ * _KLTComputePyramid
+ *
+ * Builds the pyramid of img.  Each level is smoothed and subsampled
+ * from the one before in a single pass that computes only the pixels
+ * kept.  The caller can save a copy by computing img directly into
+ * pyramid->img[0] and passing that.
  */
 
 void _KLTComputePyramid(
+  KLT_TrackingContext tc,
   _KLT_FloatImage img, 
   _KLT_Pyramid pyramid,
   float sigma_fact)
 {
-  _KLT_FloatImage currimg, tmpimg;
+  int ncols = img->ncols, nrows = img->nrows;
+  int subsampling = pyramid->subsampling;
+  float sigma = subsampling * sigma_fact;  /* empirically determined */
+  int i, y;
+	
+  if (subsampling != 2 && subsampling != 4 && 
+      subsampling != 8 && subsampling != 16 && subsampling != 32)
+    KLTError("(_KLTComputePyramid)  Pyramid's subsampling must "
+             "be either 2, 4, 8, 16, or 32");
+
+  assert(pyramid->ncols[0] == img->ncols);
+  assert(pyramid->nrows[0] == img->nrows);
+
+  /* Copy original image to level 0 of pyramid, unless it is already */
+  if (img != pyramid->img[0])
+    for (y = 0 ; y < nrows ; y++)
+      memcpy(pyramid->img[0]->data + y*pyramid->img[0]->stride,
+             img->data + y*img->stride, ncols*sizeof(float));
+
+  for (i = 1 ; i < pyramid->nLevels ; i++)
+    _KLTComputeSmoothedSubsampledImage(tc, pyramid->img[i-1], sigma,
+                                       subsampling, pyramid->img[i]);
+}
+
+
+/*********************************************************************
+ * _KLTComputeFixedPyramid
+ *
+ * Same as _KLTComputePyramid(), but for the tracking context's
+ * fixedPoint mode:  the levels are smoothed and subsampled as
+ * fixed-point images, and each level is converted to floating point
+ * only once, for the gradients and tracking.
+ */
+
+void _KLTComputeFixedPyramid(
+  KLT_TrackingContext tc,
+  _KLT_ShortImage img, 
+  _KLT_Pyramid pyramid,
+  float sigma_fact)
+{
+  _KLT_ShortImage currimg, nextimg, tmpimg;
   int ncols = img->ncols, nrows = img->nrows;
   int subsampling = pyramid->subsampling;
   int subhalf = subsampling / 2;
@@ -99,45 +271,35 @@ void _KLTComputePyramid(
 	
   if (subsampling != 2 && subsampling != 4 && 
       subsampling != 8 && subsampling != 16 && subsampling != 32)
-    KLTError("(_KLTComputePyramid)  Pyramid's subsampling must "
+    KLTError("(_KLTComputeFixedPyramid)  Pyramid's subsampling must "
              "be either 2, 4, 8, 16, or 32");
 
   assert(pyramid->ncols[0] == img->ncols);
   assert(pyramid->nrows[0] == img->nrows);
 
-  /* Copy original image to level 0 of pyramid */
-  memcpy(pyramid->img[0]->data, img->data, ncols*nrows*sizeof(float));
+  /* Level 0 is the original image */
+  _KLTFixedToFloatImage(img, pyramid->img[0]);
 
   currimg = img;
+  tmpimg = _KLTGetScratchShortImage(tc, _KLT_SCRATCH_PYRAMID_FIXED,
+                                    ncols, nrows);
+  nextimg = _KLTGetScratchShortImage(tc, _KLT_SCRATCH_PYRAMID_FIXED2,
+                                     ncols/subsampling, nrows/subsampling);
   for (i = 1 ; i < pyramid->nLevels ; i++)  {
-    tmpimg = _KLTCreateFloatImage(ncols, nrows);
-    _KLTComputeSmoothedImage(currimg, sigma, tmpimg);
+    tmpimg->ncols = ncols;  tmpimg->nrows = nrows;
+    _KLTComputeSmoothedFixedImage(tc, currimg, sigma, tmpimg);
 
-
-    /* Subsample */
+    /* Subsample; nextimg may overwrite currimg once it is smoothed */
     oldncols = ncols;
     ncols /= subsampling;  nrows /= subsampling;
+    nextimg->ncols = ncols;  nextimg->nrows = nrows;
     for (y = 0 ; y < nrows ; y++)
       for (x = 0 ; x < ncols ; x++)
-        pyramid->img[i]->data[y*ncols+x] = 
+        nextimg->data[y*ncols+x] = 
           tmpimg->data[(subsampling*y+subhalf)*oldncols +
-                      (subsampling*x+subhalf)];
+                       (subsampling*x+subhalf)];
 
-    /* Reassign current image */
-    currimg = pyramid->img[i];
-				
-    _KLTFreeFloatImage(tmpimg);
+    _KLTFixedToFloatImage(nextimg, pyramid->img[i]);
+    currimg = nextimg;
   }
 }
- 
-
-
-
-
-
-
-
-
-
-
-
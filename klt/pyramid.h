@@ -5,6 +5,7 @@
 #ifndef _PYRAMID_H_
 #define _PYRAMID_H_
 
+#include "klt.h"
 #include "klt_util.h"
 
 typedef struct  {
@@ -19,14 +20,42 @@ _KLT_Pyramid _KLTCreatePyramid(
   int ncols,
   int nrows,
   int subsampling,
-  int nlevels);
+  int nlevels,
+  int storage);
 
 void _KLTComputePyramid(
+  KLT_TrackingContext tc,
   _KLT_FloatImage floatimg, 
   _KLT_Pyramid pyramid,
   float sigma_fact);
 
+void _KLTComputeFixedPyramid(
+  KLT_TrackingContext tc,
+  _KLT_ShortImage img, 
+  _KLT_Pyramid pyramid,
+  float sigma_fact);
+
 void _KLTFreePyramid(
   _KLT_Pyramid pyramid);
 
+_KLT_Pyramid _KLTGetPyramid(
+  KLT_TrackingContext tc,
+  int ncols,
+  int nrows,
+  int subsampling,
+  int nlevels,
+  int storage);
+
+void _KLTReleasePyramid(
+  KLT_TrackingContext tc,
+  _KLT_Pyramid pyramid);
+
+void _KLTFreePyramidSpares(
+  void *spares);
+
+_KLT_Pyramid _KLTGrowPyramid(
+  KLT_TrackingContext tc,
+  _KLT_Pyramid pyramid,
+  int nlevels);
+
 #endif
@@ -9,6 +9,9 @@
 #include <stdio.h>  /* fflush()          */
 #include <string.h> /* memset()          */
 #include <math.h>   /* fsqrt()           */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* Our includes */
 #include "base.h"
@@ -22,6 +25,17 @@ int KLT_verbose = 1;
 
 typedef enum {SELECTING_ALL, REPLACING_SOME} selectionMode;
 
+/* Candidates sorted at a time by feature selection, for each feature */
+/* still wanted and at the least.  Pixels near a good feature are */
+/* usually good too, so enforcing mindist uses up several for each */
+/* feature it adds. */
+#define CANDIDATES_PER_FEATURE  32
+#define MIN_CANDIDATES  1024
+
+/* Bands' worth of candidates kept from computing trackabilities, and */
+/* how many times more to keep each time those run out */
+#define BANDS_KEPT  2
+
 
 /*********************************************************************
  * _quicksort
@@ -32,13 +46,10 @@ typedef enum {SELECTING_ALL, REPLACING_SOME} selectionMode;
  * This routine generously provided by 
  *      Manolis Lourakis <lourakis@csi.forth.gr>
  *
- * NOTE: The results of this function may be slightly different from
- * those of qsort().  This is due to the fact that different sort 
- * algorithms have different behaviours when sorting numbers with the 
- * same value: Some leave them in the same relative positions in the 
- * array, while others change their relative positions. For example, 
- * if you have the array [c d b1 a b2] with b1=b2, it may be sorted as 
- * [a b1 b2 c d] or [a b2 b1 c d].
+ * Points are sorted by _pointPrecedes(), which orders points of equal
+ * trackability by row and then column.  No two points compare equal,
+ * so the order does not depend on the sort algorithm, or on how the
+ * points were split up before sorting, and qsort() gives the same.
  */
 
 #define SWAP3(list, i, j)               \
@@ -58,6 +69,17 @@ typedef enum {SELECTING_ALL, REPLACING_SOME} selectionMode;
      *pj=tmp;    \
 }
 
+/* Whether point a, an (x, y, val) triplet, sorts before point b: */
+/* higher trackability first, then by row and column */
+static int _pointPrecedes(
+  const int *a,
+  const int *b)
+{
+  if (a[2] != b[2])  return a[2] > b[2];
+  if (a[1] != b[1])  return a[1] < b[1];
+  return a[0] < b[0];
+}
+
 void _quicksort(int *pointlist, int n)
 {
   unsigned int i, j, ln, rn;
@@ -69,10 +91,10 @@ void _quicksort(int *pointlist, int n)
     {
       do
         --j;
-      while (pointlist[3*j+2] < pointlist[2]);
+      while (_pointPrecedes(pointlist, pointlist + 3*j));
       do
         ++i;
-      while (i < j && pointlist[3*i+2] > pointlist[2]);
+      while (i < j && _pointPrecedes(pointlist + 3*i, pointlist));
       if (i >= j)
         break;
       SWAP3(pointlist, i, j);
@@ -96,21 +118,203 @@ void _quicksort(int *pointlist, int n)
 #undef SWAP3
 
 
-/*********************************************************************/
+/*********************************************************************
+ * _OccupancyGrid
+ *
+ * Where features have been placed, for enforcing mindist without an
+ * image-sized map.  The image is divided into square cells mindist
+ * pixels across, or MIN_GRID_CELL if that is more, each with a list of
+ * the features in it, so the only features near a pixel are in the
+ * cells around it, at most three by three.  With a quota, features
+ * are also counted in coarser cells, quota_cell_size pixels across.
+ */
 
-static void _fillFeaturemap(
-  int x, int y, 
-  uchar *featuremap, 
-  int mindist, 
-  int ncols, 
-  int nrows)
+typedef struct  {
+  int range;		/* features this close (mindist-1) are too close */
+  int cellsize;
+  int ncols, nrows;	/* # of cells */
+  int *head;		/* first feature in each cell, or -1 */
+  int *next;		/* next feature in the same cell, or -1 */
+  int *x, *y;		/* location of each feature */
+  int nfeatures;
+  int quota;		/* most features in each quota cell, or 0 */
+  int qcellsize;
+  int qncols, qnrows;
+  int *qcount;		/* # of features in each quota cell */
+}  _OccupancyGrid;
+
+/* Smallest cell, so that a small mindist does not make a cell of */
+/* every pixel */
+#define MIN_GRID_CELL  16
+
+/* Sets grid up for up to nfeatures features with tc's mindist and */
+/* quota, in an ncols by nrows image */
+static void _initOccupancyGrid(
+  KLT_TrackingContext tc,
+  _OccupancyGrid *grid,
+  int ncols,
+  int nrows,
+  int nfeatures)
+{
+  int ncells, nqcells;
+
+  grid->range = tc->mindist - 1;
+  grid->cellsize = (grid->range + 1 > MIN_GRID_CELL) ?
+    grid->range + 1 : MIN_GRID_CELL;
+  grid->ncols = (ncols + grid->cellsize - 1) / grid->cellsize;
+  grid->nrows = (nrows + grid->cellsize - 1) / grid->cellsize;
+  ncells = grid->ncols * grid->nrows;
+
+  grid->quota = (tc->quota_per_cell > 0 && tc->quota_cell_size > 0) ?
+    tc->quota_per_cell : 0;
+  grid->qcellsize = (grid->quota > 0) ? tc->quota_cell_size : ncols + nrows;
+  grid->qncols = (ncols + grid->qcellsize - 1) / grid->qcellsize;
+  grid->qnrows = (nrows + grid->qcellsize - 1) / grid->qcellsize;
+  nqcells = grid->qncols * grid->qnrows;
+
+  grid->head = (int *) _KLTGetScratch(tc, _KLT_SCRATCH_OCCUPANCY,
+                 (ncells + 3*nfeatures + nqcells) * sizeof(int));
+  grid->next = grid->head + ncells;
+  grid->x = grid->next + nfeatures;
+  grid->y = grid->x + nfeatures;
+  grid->qcount = grid->y + nfeatures;
+  grid->nfeatures = 0;
+}
+
+/* Cell, of ncells across, holding coordinate v, for features off */
+/* the image too */
+static int _gridCell(
+  int v,
+  int cellsize,
+  int ncells)
+{
+  if (v < 0)  return 0;
+  v /= cellsize;
+  return (v < ncells) ? v : ncells - 1;
+}
+
+static void _addToGrid(
+  _OccupancyGrid *grid,
+  int x,
+  int y)
+{
+  int n = grid->nfeatures++;
+  int cell = _gridCell(y, grid->cellsize, grid->nrows) * grid->ncols +
+    _gridCell(x, grid->cellsize, grid->ncols);
+
+  grid->x[n] = x;
+  grid->y[n] = y;
+  grid->next[n] = grid->head[cell];
+  grid->head[cell] = n;
+  grid->qcount[_gridCell(y, grid->qcellsize, grid->qnrows) * grid->qncols +
+               _gridCell(x, grid->qcellsize, grid->qncols)]++;
+}
+
+/* Whether a feature at (x,y) would be too close to one already there, */
+/* or its quota cell is full */
+static KLT_BOOL _gridIsOccupied(
+  _OccupancyGrid *grid,
+  int x,
+  int y)
+{
+  int r = grid->range;
+  int cx0, cx1, cy0, cy1, cx, cy;
+  int n;
+
+  if (grid->quota > 0 &&
+      grid->qcount[_gridCell(y, grid->qcellsize, grid->qnrows) * grid->qncols +
+                   _gridCell(x, grid->qcellsize, grid->qncols)] >= grid->quota)
+    return TRUE;
+
+  if (r < 0)  return FALSE;
+
+  cx0 = _gridCell(x - r, grid->cellsize, grid->ncols);
+  cx1 = _gridCell(x + r, grid->cellsize, grid->ncols);
+  cy0 = _gridCell(y - r, grid->cellsize, grid->nrows);
+  cy1 = _gridCell(y + r, grid->cellsize, grid->nrows);
+  for (cy = cy0 ; cy <= cy1 ; cy++)
+    for (cx = cx0 ; cx <= cx1 ; cx++)
+      for (n = grid->head[cy * grid->ncols + cx] ; n >= 0 ; n = grid->next[n])
+        if (abs(grid->x[n] - x) <= r && abs(grid->y[n] - y) <= r)
+          return TRUE;
+
+  return FALSE;
+}
+
+
+/* Empties the grid, then adds fs's good features unless they are all */
+/* about to be overwritten */
+static void _fillGrid(
+  _OccupancyGrid *grid,
+  KLT_FeatureStore fs,
+  KLT_BOOL overwriteAllFeatures)
 {
-  int ix, iy;
+  int indx;
+
+  grid->nfeatures = 0;
+  for (indx = 0 ; indx < grid->ncols * grid->nrows ; indx++)
+    grid->head[indx] = -1;
+  for (indx = 0 ; indx < grid->qncols * grid->qnrows ; indx++)
+    grid->qcount[indx] = 0;
+
+  if (!overwriteAllFeatures)
+    for (indx = 0 ; indx < fs->nFeatures ; indx++)
+      if (fs->val[indx] >= 0)
+        _addToGrid(grid, (int) fs->x[indx], (int) fs->y[indx]);
+}
+
+/* Zeroes the n values of row y, at columns x0, x0+step, ..., where */
+/* _gridIsOccupied would turn a feature away */
+static void _maskOccupied(
+  const _OccupancyGrid *grid,
+  int y,
+  int x0,
+  int step,
+  int n,
+  int *row)
+{
+  int r = grid->range;
+  int cy0, cy1, cx, cy, qx, qy;
+  int lo, hi, k, f;
+
+  if (grid->quota > 0)  {
+    qy = _gridCell(y, grid->qcellsize, grid->qnrows);
+    for (qx = 0 ; qx < grid->qncols ; qx++)
+      if (grid->qcount[qy * grid->qncols + qx] >= grid->quota)  {
+        lo = qx * grid->qcellsize;
+        hi = (qx < grid->qncols - 1) ? lo + grid->qcellsize : x0 + n*step;
+        for (k = (lo > x0) ? (lo - x0 + step - 1) / step : 0 ;
+             k < n && x0 + k*step < hi ; k++)
+          row[k] = 0;
+      }
+  }
+
+  if (r < 0)  return;
 
-  for (iy = y - mindist ; iy <= y + mindist ; iy++)
-    for (ix = x - mindist ; ix <= x + mindist ; ix++)
-      if (ix >= 0 && ix < ncols && iy >= 0 && iy < nrows)
-        featuremap[iy*ncols+ix] = 1;
+  cy0 = _gridCell(y - r, grid->cellsize, grid->nrows);
+  cy1 = _gridCell(y + r, grid->cellsize, grid->nrows);
+  for (cy = cy0 ; cy <= cy1 ; cy++)
+    for (cx = 0 ; cx < grid->ncols ; cx++)
+      for (f = grid->head[cy * grid->ncols + cx] ; f >= 0 ; f = grid->next[f])
+        if (abs(grid->y[f] - y) <= r)  {
+          lo = grid->x[f] - r - x0;
+          hi = grid->x[f] + r - x0;
+          for (k = (lo > 0) ? (lo + step - 1) / step : 0 ;
+               k < n && k*step <= hi ; k++)
+            row[k] = 0;
+        }
+}
+
+
+/* A feature newly placed, or lost, has not moved yet */
+static void _resetMotion(
+  KLT_FeatureStore fs,
+  int indx)
+{
+  if (fs->age != NULL)  {
+    fs->vx[indx] = fs->vy[indx] = 0.0;
+    fs->age[indx] = 0;
+  }
 }
 
 
@@ -120,49 +324,35 @@ static void _fillFeaturemap(
  * Removes features that are within close proximity to better features.
  *
  * INPUTS
- * featurelist:  A list of features.  The nFeatures property
- *               is used.
+ * fs:  A store of features.  The nFeatures property is used.
  *
  * OUTPUTS
- * featurelist:  Is overwritten.  Nearby "redundant" features are removed.
- *               Writes -1's into the remaining elements.
+ * fs:  Is overwritten.  Nearby "redundant" features are removed.
+ *      Writes -1's into the remaining elements.  Features written
+ *      have their motion, if the store keeps it, reset.
  *
  * RETURNS
- * The number of remaining features.
+ * The number of features left unfilled when the points ran out.
  */
 
-static void _enforceMinimumDistance(
+static int _enforceMinimumDistance(
   int *pointlist,              /* featurepoints */
   int npoints,                 /* number of featurepoints */
-  KLT_FeatureList featurelist, /* features */
-  int ncols, int nrows,        /* size of images */
-  int mindist,                 /* min. dist b/w features */
+  KLT_FeatureStore fs,         /* features */
   int min_eigenvalue,          /* min. eigenvalue */
-  KLT_BOOL overwriteAllFeatures)
+  KLT_BOOL overwriteAllFeatures,
+  _OccupancyGrid *grid)        /* set up for fs->nFeatures features */
 {
   int indx;          /* Index into features */
   int x, y, val;     /* Location and trackability of pixel under consideration */
-  uchar *featuremap; /* Boolean array recording proximity of features */
   int *ptr;
+  int nunfilled = 0;
 	
   /* Cannot add features with an eigenvalue less than one */
   if (min_eigenvalue < 1)  min_eigenvalue = 1;
 
-  /* Allocate memory for feature map and clear it */
-  featuremap = (uchar *) malloc(ncols * nrows * sizeof(uchar));
-  memset(featuremap, 0, ncols*nrows);
-	
-  /* Necessary because code below works with (mindist-1) */
-  mindist--;
-
-  /* If we are keeping all old good features, then add them to the featuremap */
-  if (!overwriteAllFeatures)
-    for (indx = 0 ; indx < featurelist->nFeatures ; indx++)
-      if (featurelist->feature[indx]->val >= 0)  {
-        x   = (int) featurelist->feature[indx]->x;
-        y   = (int) featurelist->feature[indx]->y;
-        _fillFeaturemap(x, y, featuremap, mindist, ncols, nrows);
-      }
+  /* Record proximity of the features being kept */
+  _fillGrid(grid, fs, overwriteAllFeatures);
 
   /* For each feature point, in descending order of importance, do ... */
   ptr = pointlist;
@@ -170,14 +360,16 @@ static void _enforceMinimumDistance(
   while (1)  {
 
     /* If we can't add all the points, then fill in the rest
-       of the featurelist with -1's */
+       of the store with -1's */
     if (ptr >= pointlist + 3*npoints)  {
-      while (indx < featurelist->nFeatures)  {	
+      while (indx < fs->nFeatures)  {	
         if (overwriteAllFeatures || 
-            featurelist->feature[indx]->val < 0) {
-          featurelist->feature[indx]->x   = -1;
-          featurelist->feature[indx]->y   = -1;
-          featurelist->feature[indx]->val = KLT_NOT_FOUND;
+            fs->val[indx] < 0) {
+          fs->x[indx]   = -1;
+          fs->y[indx]   = -1;
+          fs->val[indx] = KLT_NOT_FOUND;
+          _resetMotion(fs, indx);
+          nunfilled++;
         }
         indx++;
       }
@@ -187,36 +379,28 @@ static void _enforceMinimumDistance(
     x   = *ptr++;
     y   = *ptr++;
     val = *ptr++;
-		
-    /* Ensure that feature is in-bounds */
-    assert(x >= 0);
-    assert(x < ncols);
-    assert(y >= 0);
-    assert(y < nrows);
 	
     while (!overwriteAllFeatures && 
-           indx < featurelist->nFeatures &&
-           featurelist->feature[indx]->val >= 0)
+           indx < fs->nFeatures &&
+           fs->val[indx] >= 0)
       indx++;
 
-    if (indx >= featurelist->nFeatures)  break;
+    if (indx >= fs->nFeatures)  break;
 
     /* If no neighbor has been selected, and if the minimum
        eigenvalue is large enough, then add feature to the current list */
-    if (!featuremap[y*ncols+x] && val >= min_eigenvalue)  {
-      featurelist->feature[indx]->x   = (KLT_locType) x;
-      featurelist->feature[indx]->y   = (KLT_locType) y;
-      featurelist->feature[indx]->val = (int) val;
+    if (val >= min_eigenvalue && !_gridIsOccupied(grid, x, y))  {
+      fs->x[indx]   = (KLT_locType) x;
+      fs->y[indx]   = (KLT_locType) y;
+      fs->val[indx] = (int) val;
+      _resetMotion(fs, indx);
       indx++;
 
-      /* Fill in surrounding region of feature map, but
-         make sure that pixels are in-bounds */
-      _fillFeaturemap(x, y, featuremap, mindist, ncols, nrows);
+      _addToGrid(grid, x, y);
     }
   }
 
-  /* Free feature map  */
-  free(featuremap);
+  return nunfilled;
 }
 
 
@@ -224,19 +408,14 @@ static void _enforceMinimumDistance(
  * _comparePoints
  *
  * Used by qsort (in _KLTSelectGoodFeatures) to determine
- * which feature is better.
- * By switching the '>' with the '<', qsort is fooled into sorting 
- * in descending order.
+ * which feature is better, in the order of _pointPrecedes().
  */
 
 #ifdef KLT_USE_QSORT
 static int _comparePoints(const void *a, const void *b)
 {
-  int v1 = *(((int *) a) + 2);
-  int v2 = *(((int *) b) + 2);
-
-  if (v1 > v2)  return(-1);
-  else if (v1 < v2)  return(1);
+  if (_pointPrecedes((const int *) a, (const int *) b))  return(-1);
+  else if (_pointPrecedes((const int *) b, (const int *) a))  return(1);
   else return(0);
 }
 #endif
@@ -273,23 +452,468 @@ static float _minEigenvalue(float gxx, float gxy, float gyy)
 }
 	
 
+/*********************************************************************
+ * KLTMinEigenvalueScore
+ *
+ * The same for n matrices at once:  the score of KLT_DETECT_MIN_EIGENVALUE,
+ * for tc->score.
+ */
+
+void KLTMinEigenvalueScore(
+  const float *gxx,
+  const float *gxy,
+  const float *gyy,
+  int n,
+  float *val)
+{
+  int i = 0;
+
+#ifdef __SSE2__
+  {
+    const __m128 four = _mm_set1_ps(4.0f), half = _mm_set1_ps(0.5f);
+    __m128 xx, xy, yy, d;
+
+    for ( ; i + 4 <= n ; i += 4)  {
+      xx = _mm_loadu_ps(gxx + i);
+      xy = _mm_loadu_ps(gxy + i);
+      yy = _mm_loadu_ps(gyy + i);
+      d = _mm_sub_ps(xx, yy);
+      d = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(d, d),
+                                 _mm_mul_ps(_mm_mul_ps(four, xy), xy)));
+      _mm_storeu_ps(val + i, _mm_mul_ps(_mm_sub_ps(_mm_add_ps(xx, yy), d),
+                                        half));
+    }
+  }
+#endif
+
+  for ( ; i < n ; i++)
+    val[i] = _minEigenvalue(gxx[i], gxy[i], gyy[i]);
+}
+
+
+/*********************************************************************
+ * _harrisResponse
+ *
+ * The Harris corner response det - k*trace^2 of the same matrix, or
+ * zero if negative, as its square root so that it is in the units of
+ * an eigenvalue: for a window whose eigenvalues are both e, it is
+ * about 0.92e.
+ */
+
+#define HARRIS_K 0.04f
+
+static float _harrisResponse(float gxx, float gxy, float gyy)
+{
+  float t = gxx + gyy;
+  float r = gxx*gyy - gxy*gxy - HARRIS_K*(t*t);
+
+  return (r > 0.0f) ? sqrtf(r) : 0.0f;
+}
+
+
+/*********************************************************************
+ * KLTHarrisScore
+ *
+ * The same for n matrices at once:  the score of KLT_DETECT_HARRIS, for
+ * tc->score.
+ */
+
+void KLTHarrisScore(
+  const float *gxx,
+  const float *gxy,
+  const float *gyy,
+  int n,
+  float *val)
+{
+  int i = 0;
+
+#ifdef __SSE2__
+  {
+    const __m128 k = _mm_set1_ps(HARRIS_K), zero = _mm_setzero_ps();
+    __m128 xx, xy, yy, t, r;
+
+    for ( ; i + 4 <= n ; i += 4)  {
+      xx = _mm_loadu_ps(gxx + i);
+      xy = _mm_loadu_ps(gxy + i);
+      yy = _mm_loadu_ps(gyy + i);
+      t = _mm_add_ps(xx, yy);
+      r = _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(xx, yy), _mm_mul_ps(xy, xy)),
+                     _mm_mul_ps(k, _mm_mul_ps(t, t)));
+      _mm_storeu_ps(val + i, _mm_sqrt_ps(_mm_max_ps(r, zero)));
+    }
+  }
+#endif
+
+  for ( ; i < n ; i++)
+    val[i] = _harrisResponse(gxx[i], gxy[i], gyy[i]);
+}
+
+
+/*********************************************************************
+ * _addRowProducts
+ *
+ * Adds weight (1 or -1) times the gradient products gx*gx, gx*gy and
+ * gy*gy of n pixels of row y, from column x0 on, to running column
+ * sums.  Products of floats are exact in double, but each sum rounds
+ * as rows are added and taken away, so it drifts by up to about
+ * 2^-53 of its largest value per row; over a frame this stays many
+ * orders of magnitude below the float precision of the scores made
+ * from it.
+ */
+
+static void _addRowProducts(
+  _KLT_FloatImage gradx,
+  _KLT_FloatImage grady,
+  int y,
+  int x0,
+  int n,
+  double weight,
+  double *sxx,
+  double *sxy,
+  double *syy)
+{
+  const float *gxrow = gradx->data + gradx->stride*y + x0;
+  const float *gyrow = grady->data + grady->stride*y + x0;
+  double gx, gy;
+  int i;
+
+  for (i = 0 ; i < n ; i++)  {
+    gx = gxrow[i];
+    gy = gyrow[i];
+    sxx[i] += weight * (gx * gx);
+    sxy[i] += weight * (gx * gy);
+    syy[i] += weight * (gy * gy);
+  }
+}
+
+
+/*********************************************************************
+ * _trackabilityBin
+ *
+ * Trackabilities are counted in bins by their leading bits as floats,
+ * the exponent and three bits of mantissa, so that a bin's values are
+ * within an eighth of each other.  Higher bins hold higher values.
+ */
+
+#define TRACKABILITY_BINS  2048
+
+static int _trackabilityBin(
+  int val)
+{
+  union { float f; unsigned int u; } v;
+
+  v.f = (float) val;
+  return v.u >> 20;
+}
+
+
+/*********************************************************************
+ * _Candidates
+ *
+ * The best candidates found by _computeTrackability(): those whose
+ * trackabilities fall in bins [lo, hi) of the histogram, as (x, y, val)
+ * triplets in no particular order.  They are kept in one of two scratch
+ * slots, moving to the other when they need more room.
+ */
+
+typedef struct  {
+  int *point;
+  int npoints;
+  int room;		/* # of points there is room for */
+  _KLT_ScratchSlot slot;
+  int lo;
+  int ndropped;		/* # of points below lo left out */
+  int histogram[TRACKABILITY_BINS];	/* # of points in each bin */
+}  _Candidates;
+
+/* Drops the lowest bins of the candidates, as long as those left */
+/* number at least maxpoints */
+static void _dropCandidates(
+  _Candidates *cand,
+  int maxpoints)
+{
+  int i, n;
+
+  for (n = cand->npoints ; n - cand->histogram[cand->lo] >= maxpoints ; )
+    n -= cand->histogram[cand->lo++];
+  if (n == cand->npoints)  return;
+
+  for (i = n = 0 ; i < cand->npoints ; i++)
+    if (_trackabilityBin(cand->point[3*i+2]) >= cand->lo)  {
+      cand->point[3*n]   = cand->point[3*i];
+      cand->point[3*n+1] = cand->point[3*i+1];
+      cand->point[3*n+2] = cand->point[3*i+2];
+      n++;
+    }
+  cand->ndropped += cand->npoints - n;
+  cand->npoints = n;
+}
+
+/* Doubles the room for the candidates */
+static void _growCandidates(
+  KLT_TrackingContext tc,
+  _Candidates *cand)
+{
+  int *point;
+
+  cand->slot = (cand->slot == _KLT_SCRATCH_CANDIDATES) ?
+    _KLT_SCRATCH_CANDIDATES2 : _KLT_SCRATCH_CANDIDATES;
+  cand->room *= 2;
+  point = (int *) _KLTGetScratch(tc, cand->slot,
+                                 cand->room * 3 * sizeof(int));
+  memcpy(point, cand->point, cand->npoints * 3 * sizeof(int));
+  cand->point = point;
+}
+
+
+/*********************************************************************
+ * _bandRows
+ *
+ * The rows considered for features, y0 to y1-1, that fall in band of
+ * nbands equal bands.
+ */
+
+static void _bandRows(
+  KLT_TrackingContext tc,
+  int nrows,
+  int window_hh,
+  int band,
+  int nbands,
+  int *y0,
+  int *y1)
+{
+  int bordery = tc->bordery;	/* lost by convolution */
+  int step = tc->nSkippedPixels + 1;
+  int nrows_all;
+
+  if (bordery < window_hh)  bordery = window_hh;
+  nrows_all = (nrows - 2*bordery > 0) ?
+    (nrows - 2*bordery + step - 1) / step : 0;
+  *y0 = bordery + step * (nrows_all * band / nbands);
+  *y1 = bordery + step * (nrows_all * (band + 1) / nbands);
+  if (*y1 > nrows - bordery)  *y1 = nrows - bordery;
+}
+
+
+/*********************************************************************
+ * _computeTrackability
+ *
+ * Computes the trackability of each pixel considered, as score gives
+ * it from the Z matrix of the window around it, and keeps the best
+ * candidates in cand:  of those at least min_eigenvalue and in bins
+ * below hi, the ones in the fewest top bins that hold maxpoints of
+ * them, or all of them if there are fewer.  The bins kept are found as
+ * the pixels come, by dropping the lowest whenever cand fills up, so
+ * cand stays about twice maxpoints however large the image is, unless
+ * a single bin holds more.
+ * Only rows y0 to y1-1 are computed, and if grid is given, pixels it
+ * would turn away count as zero.
+ * The window sums of the gradient products are kept as running sums:
+ * one per column over the window's rows, slid down the image a row at
+ * a time, and one over the window's columns, slid along each row.
+ */
+
+static void _computeTrackability(
+  KLT_TrackingContext tc,
+  _KLT_FloatImage gradx,
+  _KLT_FloatImage grady,
+  int window_hw,
+  int window_hh,
+  KLT_ScoreFunc score,
+  int min_eigenvalue,
+  int y0,
+  int y1,
+  const _OccupancyGrid *grid,
+  int hi,
+  int maxpoints,
+  _Candidates *cand)
+{
+  int ncols = gradx->ncols;
+  double *sxx, *sxy, *syy;	/* column sums */
+  double hxx, hxy, hyy;	/* window sums */
+  float *wxx, *wxy, *wyy, *wval;
+  float val;
+  unsigned int limit = 1;
+  int borderx = tc->borderx;	/* Must not touch cols */
+  int step = tc->nSkippedPixels + 1;
+  int x0, nx, nout;
+  int npixels;
+  int *out, *pt;
+  int y, c, k, bin;
+  int i;
+	
+  if (borderx < window_hw)  borderx = window_hw;
+
+  /* Find largest value of an int */
+  for (i = 0 ; i < sizeof(int) ; i++)  limit *= 256;
+  limit = limit/2 - 1;
+
+  /* Columns covered by some window, and windows per row */
+  x0 = borderx - window_hw;
+  nx = ncols - 2*x0;
+  nout = (ncols - 2*borderx + step - 1) / step;
+  if (nout < 0)  nout = 0;
+
+  /* Room for twice maxpoints, or for every pixel if there are fewer */
+  npixels = (y1 > y0) ? nout * ((y1 - y0 + step - 1) / step) : 0;
+  cand->room = (2*maxpoints < npixels) ? 2*maxpoints : npixels;
+  if (cand->room < 1)  cand->room = 1;
+  cand->slot = _KLT_SCRATCH_CANDIDATES;
+  cand->point = (int *) _KLTGetScratch(tc, cand->slot,
+                                       cand->room * 3 * sizeof(int));
+  cand->npoints = 0;
+  cand->lo = 0;
+  cand->ndropped = 0;
+  memset(cand->histogram, 0, TRACKABILITY_BINS * sizeof(int));
+
+  if (npixels > 0)  {
+    sxx = (double *) _KLTGetScratch(tc, _KLT_SCRATCH_SELECT_SUMS,
+                       3*nx*sizeof(double) + 4*nout*sizeof(float) +
+                       nout*sizeof(int));
+    sxy = sxx + nx;
+    syy = sxy + nx;
+    wxx = (float *) (syy + nx);
+    wxy = wxx + nout;
+    wyy = wxy + nout;
+    wval = wyy + nout;
+    out = (int *) (wval + nout);
+
+    /* Start with all but the last row of the first windows */
+    memset(sxx, 0, 3*nx*sizeof(double));
+    for (y = y0 - window_hh ; y < y0 + window_hh ; y++)
+      _addRowProducts(gradx, grady, y, x0, nx, 1.0, sxx, sxy, syy);
+
+    /* For most of the pixels in the band, do ... */
+    for (y = y0 ; y < y1 ; y++)  {
+      _addRowProducts(gradx, grady, y + window_hh, x0, nx, 1.0,
+                      sxx, sxy, syy);
+
+      if ((y - y0) % step == 0)  {
+
+        /* Sum the gradients in each window along the row */
+        hxx = 0;  hxy = 0;  hyy = 0;
+        for (c = 0 ; c < 2*window_hw ; c++)  {
+          hxx += sxx[c];  hxy += sxy[c];  hyy += syy[c];
+        }
+        k = 0;
+        for (c = window_hw ; c < nx - window_hw ; c++)  {
+          hxx += sxx[c + window_hw];
+          hxy += sxy[c + window_hw];
+          hyy += syy[c + window_hw];
+          if ((c - window_hw) % step == 0)  {
+            wxx[k] = (float) hxx;
+            wxy[k] = (float) hxy;
+            wyy[k] = (float) hyy;
+            k++;
+          }
+          hxx -= sxx[c - window_hw];
+          hxy -= sxy[c - window_hw];
+          hyy -= syy[c - window_hw];
+        }
+        assert(k == nout);
+
+        /* Score each window */
+        score(wxx, wxy, wyy, nout, wval);
+        for (k = 0 ; k < nout ; k++)  {
+          val = wval[k];
+          if (val > limit)  {
+            KLTWarning("(_KLTSelectGoodFeatures) trackability %f is "
+                       "greater than the capacity of an int; setting "
+                       "to maximum value", val);
+            val = limit;
+          }
+          out[k] = ((int) val < min_eigenvalue) ? 0 : (int) val;
+        }
+        if (grid != NULL)
+          _maskOccupied(grid, y, borderx, step, nout, out);
+
+        /* Keep those in the bins still wanted */
+        for (k = 0 ; k < nout ; k++)  {
+          if (out[k] == 0)  continue;
+          bin = _trackabilityBin(out[k]);
+          if (bin >= hi)  continue;
+          if (cand->npoints == cand->room)  {
+            _dropCandidates(cand, maxpoints);
+            if (4*cand->npoints > 3*cand->room)
+              _growCandidates(tc, cand);
+          }
+          if (bin < cand->lo)  {
+            cand->ndropped++;
+            continue;
+          }
+          cand->histogram[bin]++;
+          pt = cand->point + 3*cand->npoints++;
+          pt[0] = borderx + k*step;
+          pt[1] = y;
+          pt[2] = out[k];
+        }
+      }
+
+      _addRowProducts(gradx, grady, y - window_hh, x0, nx, -1.0,
+                      sxx, sxy, syy);
+    }
+  }
+
+  /* If nothing was left out, there is nothing below */
+  _dropCandidates(cand, maxpoints);
+  if (cand->ndropped == 0)  cand->lo = 0;
+}
+
+
+/*********************************************************************
+ * _partitionCandidates
+ *
+ * Moves those of the n points whose trackabilities fall in bin lo or
+ * above to the front.
+ *
+ * RETURNS
+ * The number of points moved.
+ */
+
+static int _partitionCandidates(
+  int *point,
+  int n,
+  int lo)
+{
+  int i, j, t;
+
+  for (i = j = 0 ; j < n ; j++)
+    if (_trackabilityBin(point[3*j+2]) >= lo)  {
+      if (i != j)  {
+        t = point[3*i];    point[3*i] = point[3*j];      point[3*j] = t;
+        t = point[3*i+1];  point[3*i+1] = point[3*j+1];  point[3*j+1] = t;
+        t = point[3*i+2];  point[3*i+2] = point[3*j+2];  point[3*j+2] = t;
+      }
+      i++;
+    }
+
+  return i;
+}
+
+
 /*********************************************************************/
 
 void _KLTSelectGoodFeatures(
   KLT_TrackingContext tc,
-  KLT_PixelType *img, 
-  int ncols, 
-  int nrows,
-  KLT_FeatureList featurelist,
+  KLT_Image img,
+  KLT_FeatureStore fs,
   selectionMode mode)
 {
+  int ncols = img->ncols, nrows = img->nrows;
   _KLT_FloatImage floatimg, gradx, grady;
   int window_hw, window_hh;
+  _Candidates cand;
   int *pointlist;
-  int npoints = 0;
+  int npoints, maxpoints, nkept, ntaken;
+  int nwanted;
+  int min_eigenvalue;
+  int bin, hi;
+  int band = 0, nbands = 1;
+  int y0, y1;
+  KLT_ScoreFunc score;
+  _OccupancyGrid grid;
   KLT_BOOL overwriteAllFeatures = (mode == SELECTING_ALL) ?
     TRUE : FALSE;
-  KLT_BOOL floatimages_created = FALSE;
 
   /* Check window size (and correct if necessary) */
   if (tc->window_width % 2 != 1) {
@@ -314,99 +938,84 @@ void _KLTSelectGoodFeatures(
   }
   window_hw = tc->window_width/2; 
   window_hh = tc->window_height/2;
-		
-  /* Create pointlist, which is a simplified version of a featurelist, */
-  /* for speed.  Contains only integer locations and values. */
-  pointlist = (int *) malloc(ncols * nrows * 3 * sizeof(int));
+
+  /* When replacing, maybe only search the next band of rows */
+  if (!overwriteAllFeatures && tc->replace_bands > 1)  {
+    nbands = tc->replace_bands;
+    band = tc->replace_band % nbands;
+    tc->replace_band = (band + 1) % nbands;
+  }
+  _bandRows(tc, nrows, window_hh, band, nbands, &y0, &y1);
+
 
   /* Create temporary images, etc. */
-  if (mode == REPLACING_SOME && 
+  if (tc->detector == KLT_DETECT_HARRIS)  {
+    floatimg = NULL;
+    gradx    = _KLTGetScratchFloatImage(tc, _KLT_SCRATCH_SELECT_GRADX,
+                                        ncols, nrows);
+    grady    = _KLTGetScratchFloatImage(tc, _KLT_SCRATCH_SELECT_GRADY,
+                                        ncols, nrows);
+
+    /* Only the rows under the band's windows, unless writing them out */
+    if (tc->writeInternalImages)
+      _KLTComputeSobelGradients(tc, img, 0, nrows, gradx, grady);
+    else
+      _KLTComputeSobelGradients(tc, img, y0 - window_hh, y1 + window_hh,
+                                gradx, grady);
+  } else if (mode == REPLACING_SOME && 
       tc->sequentialMode && tc->pyramid_last != NULL)  {
     floatimg = ((_KLT_Pyramid) tc->pyramid_last)->img[0];
     gradx = ((_KLT_Pyramid) tc->pyramid_last_gradx)->img[0];
     grady = ((_KLT_Pyramid) tc->pyramid_last_grady)->img[0];
     assert(gradx != NULL);
     assert(grady != NULL);
+
+    /* Widen images stored in 16 bits */
+    if (floatimg->storage != KLT_STORE_FLOAT)  {
+      _KLT_FloatImage packed[3];
+      packed[0] = floatimg;  packed[1] = gradx;  packed[2] = grady;
+      floatimg = _KLTGetScratchFloatImage(tc, _KLT_SCRATCH_SELECT_IMG,
+                                          ncols, nrows);
+      gradx    = _KLTGetScratchFloatImage(tc, _KLT_SCRATCH_SELECT_GRADX,
+                                          ncols, nrows);
+      grady    = _KLTGetScratchFloatImage(tc, _KLT_SCRATCH_SELECT_GRADY,
+                                          ncols, nrows);
+      _KLTUnpackImage(packed[0], floatimg);
+      _KLTUnpackImage(packed[1], gradx);
+      _KLTUnpackImage(packed[2], grady);
+    }
   } else  {
-    floatimages_created = TRUE;
-    floatimg = _KLTCreateFloatImage(ncols, nrows);
-    gradx    = _KLTCreateFloatImage(ncols, nrows);
-    grady    = _KLTCreateFloatImage(ncols, nrows);
-    if (tc->smoothBeforeSelecting)  {
+    floatimg = _KLTGetScratchFloatImage(tc, _KLT_SCRATCH_SELECT_IMG,
+                                        ncols, nrows);
+    gradx    = _KLTGetScratchFloatImage(tc, _KLT_SCRATCH_SELECT_GRADX,
+                                        ncols, nrows);
+    grady    = _KLTGetScratchFloatImage(tc, _KLT_SCRATCH_SELECT_GRADY,
+                                        ncols, nrows);
+    if (tc->smoothBeforeSelecting && tc->fixedPoint)  {
+      _KLT_ShortImage fixedimg;
+      fixedimg = _KLTGetScratchShortImage(tc, _KLT_SCRATCH_INPUT_FIXED,
+                                          ncols, nrows);
+      _KLTToSmoothedFixedImage(tc, img, _KLTComputeSmoothSigma(tc), fixedimg);
+      _KLTFixedToFloatImage(fixedimg, floatimg);
+    } else if (tc->smoothBeforeSelecting)  {
       _KLT_FloatImage tmpimg;
-      tmpimg = _KLTCreateFloatImage(ncols, nrows);
-      _KLTToFloatImage(img, ncols, nrows, tmpimg);
-      _KLTComputeSmoothedImage(tmpimg, _KLTComputeSmoothSigma(tc), floatimg);
-      _KLTFreeFloatImage(tmpimg);
-    } else _KLTToFloatImage(img, ncols, nrows, floatimg);
+      tmpimg = _KLTGetScratchFloatImage(tc, _KLT_SCRATCH_INPUT, ncols, nrows);
+      _KLTToFloatImage(img, tmpimg);
+      _KLTComputeSmoothedImage(tc, tmpimg, _KLTComputeSmoothSigma(tc), floatimg);
+    } else _KLTToFloatImage(img, floatimg);
  
     /* Compute gradient of image in x and y direction */
-    _KLTComputeGradients(floatimg, tc->grad_sigma, gradx, grady);
+    _KLTComputeGradients(tc, floatimg, tc->grad_sigma, gradx, grady);
   }
 	
   /* Write internal images */
   if (tc->writeInternalImages)  {
-    _KLTWriteFloatImageToPGM(floatimg, "kltimg_sgfrlf.pgm");
+    if (floatimg != NULL)
+      _KLTWriteFloatImageToPGM(floatimg, "kltimg_sgfrlf.pgm");
     _KLTWriteFloatImageToPGM(gradx, "kltimg_sgfrlf_gx.pgm");
     _KLTWriteFloatImageToPGM(grady, "kltimg_sgfrlf_gy.pgm");
   }
 
-  /* Compute trackability of each image pixel as the minimum
-     of the two eigenvalues of the Z matrix */
-  {
-    register float gx, gy;
-    register float gxx, gxy, gyy;
-    register int xx, yy;
-    register int *ptr;
-    float val;
-    unsigned int limit = 1;
-    int borderx = tc->borderx;	/* Must not touch cols */
-    int bordery = tc->bordery;	/* lost by convolution */
-    int x, y;
-    int i;
-	
-    if (borderx < window_hw)  borderx = window_hw;
-    if (bordery < window_hh)  bordery = window_hh;
-
-    /* Find largest value of an int */
-    for (i = 0 ; i < sizeof(int) ; i++)  limit *= 256;
-    limit = limit/2 - 1;
-		
-    /* For most of the pixels in the image, do ... */
-    ptr = pointlist;
-    for (y = bordery ; y < nrows - bordery ; y += tc->nSkippedPixels + 1)
-      for (x = borderx ; x < ncols - borderx ; x += tc->nSkippedPixels + 1)  {
-
-        /* Sum the gradients in the surrounding window */
-        gxx = 0;  gxy = 0;  gyy = 0;
-        for (yy = y-window_hh ; yy <= y+window_hh ; yy++)
-          for (xx = x-window_hw ; xx <= x+window_hw ; xx++)  {
-            gx = *(gradx->data + ncols*yy+xx);
-            gy = *(grady->data + ncols*yy+xx);
-            gxx += gx * gx;
-            gxy += gx * gy;
-            gyy += gy * gy;
-          }
-
-        /* Store the trackability of the pixel as the minimum
-           of the two eigenvalues */
-        *ptr++ = x;
-        *ptr++ = y;
-        val = _minEigenvalue(gxx, gxy, gyy);
-        if (val > limit)  {
-          KLTWarning("(_KLTSelectGoodFeatures) minimum eigenvalue %f is "
-                     "greater than the capacity of an int; setting "
-                     "to maximum value", val);
-          val = limit;
-        }
-        *ptr++ = (int) val;
-        npoints++;
-      }
-  }
-			
-  /* Sort the features  */
-  _sortPointList(pointlist, npoints);
-
   /* Check tc->mindist */
   if (tc->mindist < 0)  {
     KLTWarning("(_KLTSelectGoodFeatures) Tracking context field tc->mindist "
@@ -414,28 +1023,68 @@ void _KLTSelectGoodFeatures(
     tc->mindist = 0;
   }
 
-  /* Enforce minimum distance between features */
-  _enforceMinimumDistance(
-    pointlist,
-    npoints,
-    featurelist,
-    ncols, nrows,
-    tc->mindist,
-    tc->min_eigenvalue,
-    overwriteAllFeatures);
-
-  /* Free memory */
-  free(pointlist);
-  if (floatimages_created)  {
-    _KLTFreeFloatImage(floatimg);
-    _KLTFreeFloatImage(gradx);
-    _KLTFreeFloatImage(grady);
-  }
+  /* When replacing, only consider pixels where features would fit */
+  _initOccupancyGrid(tc, &grid, ncols, nrows, fs->nFeatures);
+  if (!overwriteAllFeatures)
+    _fillGrid(&grid, fs, overwriteAllFeatures);
+
+  /* Keep the best candidates, a few bands' worth */
+  min_eigenvalue = (tc->min_eigenvalue < 1) ? 1 : tc->min_eigenvalue;
+  nwanted = (overwriteAllFeatures) ? fs->nFeatures :
+    fs->nFeatures - KLTCountRemainingFeatureStore(fs);
+  nkept = nwanted * CANDIDATES_PER_FEATURE;
+  if (nkept < MIN_CANDIDATES)  nkept = MIN_CANDIDATES;
+  nkept *= BANDS_KEPT;
+  if (tc->score != NULL)  score = tc->score;
+  else if (tc->detector == KLT_DETECT_HARRIS)  score = KLTHarrisScore;
+  else  score = KLTMinEigenvalueScore;
+  hi = TRACKABILITY_BINS;
+  do  {
+    _computeTrackability(tc, gradx, grady, window_hw, window_hh, score,
+                         min_eigenvalue, y0, y1,
+                         (overwriteAllFeatures) ? NULL : &grid,
+                         hi, nkept, &cand);
+
+    /* Take them in bands of decreasing trackability, each holding */
+    /* enough to fill what is still wanted if there are that many. */
+    /* Sort each band and add features from it, while enforcing */
+    /* minimum distance between features, until the store is full or */
+    /* the candidates run out */
+    bin = hi;
+    ntaken = 0;
+    do  {
+      maxpoints = nwanted * CANDIDATES_PER_FEATURE;
+      if (maxpoints < MIN_CANDIDATES)  maxpoints = MIN_CANDIDATES;
+      for (npoints = 0 ; bin > cand.lo && npoints < maxpoints ; )
+        npoints += cand.histogram[--bin];
+
+      pointlist = cand.point + 3*ntaken;
+      npoints = _partitionCandidates(pointlist, cand.npoints - ntaken, bin);
+      _sortPointList(pointlist, npoints);
+      ntaken += npoints;
+
+      nwanted = _enforceMinimumDistance(
+        pointlist,
+        npoints,
+        fs,
+        tc->min_eigenvalue,
+        overwriteAllFeatures,
+        &grid);
+
+      /* Later bands keep what earlier ones added */
+      overwriteAllFeatures = FALSE;
+    }  while (nwanted > 0 && bin > cand.lo);
+
+    /* If those ran out, compute the trackabilities again for the next */
+    /* best, keeping more of them */
+    hi = cand.lo;
+    nkept *= BANDS_KEPT;
+  }  while (nwanted > 0 && hi > 0);
 }
 
 
 /*********************************************************************
- * KLTSelectGoodFeatures
+ * KLTSelectGoodFeatureStoreImage
  *
  * Main routine, visible to the outside.  Finds the good features in
  * an image.  
@@ -444,31 +1093,29 @@ void _KLTSelectGoodFeatures(
  * tc:	Contains parameters used in computation (size of image,
  *        size of window, min distance b/w features, sigma to compute
  *        image gradients, # of features desired).
- * img:	Pointer to the data of an image (probably unsigned chars).
+ * img:	Where the pixels of the image are (see KLT_ImageRec).
  * 
  * OUTPUTS
- * features:	List of features.  The member nFeatures is computed.
+ * fs:	Store of features.  The member nFeatures is computed.
  */
 
-void KLTSelectGoodFeatures(
+void KLTSelectGoodFeatureStoreImage(
   KLT_TrackingContext tc,
-  KLT_PixelType *img, 
-  int ncols, 
-  int nrows,
-  KLT_FeatureList fl)
+  KLT_Image img,
+  KLT_FeatureStore fs)
 {
-  if (KLT_verbose >= 1)  {
+  if (tc->verbosity >= 1)  {
     fprintf(stderr,  "(KLT) Selecting the %d best features "
-            "from a %d by %d image...  ", fl->nFeatures, ncols, nrows);
+            "from a %d by %d image...  ", fs->nFeatures,
+            img->ncols, img->nrows);
     fflush(stderr);
   }
 
-  _KLTSelectGoodFeatures(tc, img, ncols, nrows, 
-                         fl, SELECTING_ALL);
+  _KLTSelectGoodFeatures(tc, img, fs, SELECTING_ALL);
 
-  if (KLT_verbose >= 1)  {
+  if (tc->verbosity >= 1)  {
     fprintf(stderr,  "\n\t%d features found.\n", 
-            KLTCountRemainingFeatures(fl));
+            KLTCountRemainingFeatureStore(fs));
     if (tc->writeInternalImages)
       fprintf(stderr,  "\tWrote images to 'kltimg_sgfrlf*.pgm'.\n");
     fflush(stderr);
@@ -477,44 +1124,44 @@ void KLTSelectGoodFeatures(
 
 
 /*********************************************************************
- * KLTReplaceLostFeatures
+ * KLTReplaceLostFeatureStoreImage
  *
  * Main routine, visible to the outside.  Replaces the lost features 
- * in an image.  
+ * in an image.  With tc->replace_bands above one, each call searches
+ * only the next band of rows, so it can take that many calls to find
+ * all the replacements there are.
  * 
  * INPUTS
  * tc:	Contains parameters used in computation (size of image,
  *        size of window, min distance b/w features, sigma to compute
  *        image gradients, # of features desired).
- * img:	Pointer to the data of an image (probably unsigned chars).
+ * img:	Where the pixels of the image are (see KLT_ImageRec).
  * 
  * OUTPUTS
- * features:	List of features.  The member nFeatures is computed.
+ * fs:	Store of features.  The member nFeatures is computed.
  */
 
-void KLTReplaceLostFeatures(
+void KLTReplaceLostFeatureStoreImage(
   KLT_TrackingContext tc,
-  KLT_PixelType *img, 
-  int ncols, 
-  int nrows,
-  KLT_FeatureList fl)
+  KLT_Image img,
+  KLT_FeatureStore fs)
 {
-  int nLostFeatures = fl->nFeatures - KLTCountRemainingFeatures(fl);
+  int nLostFeatures = fs->nFeatures - KLTCountRemainingFeatureStore(fs);
 
-  if (KLT_verbose >= 1)  {
+  if (tc->verbosity >= 1)  {
     fprintf(stderr,  "(KLT) Attempting to replace %d features "
-            "in a %d by %d image...  ", nLostFeatures, ncols, nrows);
+            "in a %d by %d image...  ", nLostFeatures,
+            img->ncols, img->nrows);
     fflush(stderr);
   }
 
   /* If there are any lost features, replace them */
   if (nLostFeatures > 0)
-    _KLTSelectGoodFeatures(tc, img, ncols, nrows, 
-                           fl, REPLACING_SOME);
+    _KLTSelectGoodFeatures(tc, img, fs, REPLACING_SOME);
 
-  if (KLT_verbose >= 1)  {
+  if (tc->verbosity >= 1)  {
     fprintf(stderr,  "\n\t%d features replaced.\n",
-            nLostFeatures - fl->nFeatures + KLTCountRemainingFeatures(fl));
+            nLostFeatures - fs->nFeatures + KLTCountRemainingFeatureStore(fs));
     if (tc->writeInternalImages)
       fprintf(stderr,  "\tWrote images to 'kltimg_sgfrlf*.pgm'.\n");
     fflush(stderr);
@@ -522,3 +1169,74 @@ void KLTReplaceLostFeatures(
 }
 
 
+/*********************************************************************
+ * KLTSelectGoodFeatureStore
+ * KLTReplaceLostFeatureStore
+ *
+ * The same, for ncols by nrows pixels packed one after another.
+ */
+
+void KLTSelectGoodFeatureStore(
+  KLT_TrackingContext tc,
+  KLT_PixelType *img, 
+  int ncols, 
+  int nrows,
+  KLT_FeatureStore fs)
+{
+  KLT_ImageRec image;
+
+  _KLTPackedImage(img, ncols, nrows, &image);
+  KLTSelectGoodFeatureStoreImage(tc, &image, fs);
+}
+
+void KLTReplaceLostFeatureStore(
+  KLT_TrackingContext tc,
+  KLT_PixelType *img, 
+  int ncols, 
+  int nrows,
+  KLT_FeatureStore fs)
+{
+  KLT_ImageRec image;
+
+  _KLTPackedImage(img, ncols, nrows, &image);
+  KLTReplaceLostFeatureStoreImage(tc, &image, fs);
+}
+
+
+/*********************************************************************
+ * KLTSelectGoodFeatures
+ * KLTReplaceLostFeatures
+ *
+ * The same, for a feature list, which is copied into a store for the
+ * duration.
+ */
+
+void KLTSelectGoodFeatures(
+  KLT_TrackingContext tc,
+  KLT_PixelType *img, 
+  int ncols, 
+  int nrows,
+  KLT_FeatureList fl)
+{
+  KLT_FeatureStore fs = _KLTGetScratchFeatureStore(tc, _KLT_SCRATCH_FEATURES,
+                                                   fl->nFeatures);
+
+  KLTCopyFeatureListToStore(fl, fs);
+  KLTSelectGoodFeatureStore(tc, img, ncols, nrows, fs);
+  KLTCopyFeatureStoreToList(fs, fl);
+}
+
+void KLTReplaceLostFeatures(
+  KLT_TrackingContext tc,
+  KLT_PixelType *img, 
+  int ncols, 
+  int nrows,
+  KLT_FeatureList fl)
+{
+  KLT_FeatureStore fs = _KLTGetScratchFeatureStore(tc, _KLT_SCRATCH_FEATURES,
+                                                   fl->nFeatures);
+
+  KLTCopyFeatureListToStore(fl, fs);
+  KLTReplaceLostFeatureStore(tc, img, ncols, nrows, fs);
+  KLTCopyFeatureStoreToList(fs, fl);
+}
@@ -0,0 +1,192 @@
+/*********************************************************************
+ * threads.c
+ *
+ * Worker threads for splitting image processing across cores.  Each
+ * tracking context that asks for more than one thread gets its own
+ * pool, created on first use.  Callers hand out tasks that write
+ * disjoint parts of their outputs, so results do not depend on which
+ * thread runs which task.
+ *********************************************************************/
+
+/* Standard includes */
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>  /* malloc() */
+
+/* Our includes */
+#include "error.h"
+#include "klt.h"
+#include "threads.h"
+
+
+typedef struct  {
+  int nworkers;
+  pthread_t *thread;
+  pthread_mutex_t lock;
+  pthread_cond_t start;		/* signalled when a batch is posted */
+  pthread_cond_t done;		/* signalled when a batch completes */
+  int generation;		/* incremented for each batch */
+  KLT_BOOL shutdown;
+
+  /* Current batch */
+  _KLT_Task task;
+  void *arg;
+  int ntasks;
+  int next;			/* next task index to hand out */
+  int ncompleted;
+}  _KLT_ThreadPoolRec, *_KLT_ThreadPool;
+
+
+/*********************************************************************
+ * _runBatch
+ *
+ * Runs tasks from the current batch until none are left.  Called with
+ * the pool locked, and returns with it locked.
+ */
+
+static void _runBatch(
+  _KLT_ThreadPool pool)
+{
+  while (pool->next < pool->ntasks)  {
+    _KLT_Task task = pool->task;
+    void *arg = pool->arg;
+    int index = pool->next++;
+
+    pthread_mutex_unlock(&pool->lock);
+    task(arg, index);
+    pthread_mutex_lock(&pool->lock);
+
+    if (++pool->ncompleted == pool->ntasks)
+      pthread_cond_signal(&pool->done);
+  }
+}
+
+
+/*********************************************************************
+ * _worker
+ */
+
+static void *_worker(
+  void *arg)
+{
+  _KLT_ThreadPool pool = (_KLT_ThreadPool) arg;
+  int seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;)  {
+    while (pool->generation == seen && !pool->shutdown)
+      pthread_cond_wait(&pool->start, &pool->lock);
+    if (pool->shutdown)  break;
+    seen = pool->generation;
+    _runBatch(pool);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+
+/*********************************************************************
+ * _createThreadPool
+ */
+
+static _KLT_ThreadPool _createThreadPool(
+  int nworkers)
+{
+  _KLT_ThreadPool pool;
+  int i;
+
+  pool = (_KLT_ThreadPool) malloc(sizeof(_KLT_ThreadPoolRec) +
+                                  nworkers * sizeof(pthread_t));
+  if (pool == NULL)
+    KLTError("(_createThreadPool) Out of memory");
+
+  pool->nworkers = nworkers;
+  pool->thread = (pthread_t *) (pool + 1);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pool->generation = 0;
+  pool->shutdown = FALSE;
+  pool->ntasks = pool->next = pool->ncompleted = 0;
+
+  for (i = 0 ; i < nworkers ; i++)
+    if (pthread_create(&pool->thread[i], NULL, _worker, pool) != 0)
+      KLTError("(_createThreadPool) Cannot create worker thread");
+
+  return pool;
+}
+
+
+/*********************************************************************
+ * _KLTFreeThreadPool
+ */
+
+void _KLTFreeThreadPool(
+  void *p)
+{
+  _KLT_ThreadPool pool = (_KLT_ThreadPool) p;
+  int i;
+
+  if (pool == NULL)  return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = TRUE;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0 ; i < pool->nworkers ; i++)
+    pthread_join(pool->thread[i], NULL);
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+  free(pool);
+}
+
+
+/*********************************************************************
+ * _KLTRunTasks
+ *
+ * Runs task(arg, i) for each i in [0, ntasks), spread over the
+ * context's nThreads threads (the caller being one of them), and
+ * returns when all have finished.  With nThreads of one the tasks
+ * simply run in order on the calling thread.
+ */
+
+void _KLTRunTasks(
+  KLT_TrackingContext tc,
+  int ntasks,
+  _KLT_Task task,
+  void *arg)
+{
+  _KLT_ThreadPool pool = (_KLT_ThreadPool) tc->thread_pool;
+  int i;
+
+  if (tc->nThreads <= 1 || ntasks <= 1)  {
+    for (i = 0 ; i < ntasks ; i++)
+      task(arg, i);
+    return;
+  }
+
+  /* (Re)create the pool if the number of threads has changed */
+  if (pool == NULL || pool->nworkers != tc->nThreads - 1)  {
+    _KLTFreeThreadPool(pool);
+    pool = _createThreadPool(tc->nThreads - 1);
+    tc->thread_pool = pool;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->task = task;
+  pool->arg = arg;
+  pool->ntasks = ntasks;
+  pool->next = 0;
+  pool->ncompleted = 0;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->start);
+
+  _runBatch(pool);
+  while (pool->ncompleted < pool->ntasks)
+    pthread_cond_wait(&pool->done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
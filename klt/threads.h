@@ -0,0 +1,22 @@
+/*********************************************************************
+ * threads.h
+ *********************************************************************/
+
+#ifndef _THREADS_H_
+#define _THREADS_H_
+
+#include "klt.h"
+
+/* A task is called once for each index in [0, ntasks) */
+typedef void (*_KLT_Task)(void *arg, int index);
+
+void _KLTRunTasks(
+  KLT_TrackingContext tc,
+  int ntasks,
+  _KLT_Task task,
+  void *arg);
+
+void _KLTFreeThreadPool(
+  void *pool);
+
+#endif
@@ -8,6 +8,9 @@
 #include <math.h>		/* fabs() */
 #include <stdlib.h>		/* malloc() */
 #include <stdio.h>		/* fflush() */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* Our includes */
 #include "base.h"
@@ -16,45 +19,164 @@
 #include "klt.h"
 #include "klt_util.h"	/* _KLT_FloatImage */
 #include "pyramid.h"	/* _KLT_Pyramid */
-
-extern int KLT_verbose;
+#include "threads.h"	/* _KLTRunTasks */
 
 typedef float *_FloatWindow;
 
+/* Floats of scratch that tracking needs:  four windows, and the row */
+/* buffer used when sampling them (see _imageRow) */
+#define _windowScratch(width, height)  (4*(width)*(height) + 4*((width)+1))
+
 
 /*********************************************************************
- * _interpolate
- * 
- * Given a point (x,y) in an image, computes the bilinear interpolated 
- * gray-level value of the point in the image.  
+ * Window sampling
+ *
+ * Windows are sampled from the images by bilinear interpolation.  The
+ * sub-pixel offset is the same for every pixel of a window, so the
+ * four weights are computed once (_windowOrigin), and each row of the
+ * window is interpolated from two rows of the image, four pixels at a
+ * time with SSE2 where the compiler targets it.  Rows of images stored
+ * in 16 bits are widened into rowbuf first, which needs room for
+ * 4*(width+1) floats.  _interpolateRows can combine two images as it
+ * goes, so that the difference and gradient-sum windows are written in
+ * a single pass.
  */
 
-static float _interpolate(
-  float x, 
-  float y, 
-  _KLT_FloatImage img)
-{
-  int xt = (int) x;  /* coordinates of top-left corner */
-  int yt = (int) y;
-  float ax = x - xt;
-  float ay = y - yt;
-  float *ptr = img->data + (img->ncols*yt) + xt;
-
-#ifndef _DNDEBUG
-  if (xt<0 || yt<0 || xt>=img->ncols-1 || yt>=img->nrows-1) {
-    fprintf(stderr, "(xt,yt)=(%d,%d)  imgsize=(%d,%d)\n"
-            "(x,y)=(%f,%f)  (ax,ay)=(%f,%f)\n",
-            xt, yt, img->ncols, img->nrows, x, y, ax, ay);
-    fflush(stderr);
+typedef struct  {
+  int xt, yt;		/* top-left pixel of the window */
+  float w[4];		/* weights of a pixel, its right, lower and */
+			/*   lower-right neighbours */
+}  _WindowOrigin;
+
+typedef enum  {
+  _SAMPLE_ONE,		/* out = a */
+  _SAMPLE_DIFF,		/* out = a - b */
+  _SAMPLE_SUM		/* out = a + b */
+}  _SampleOp;
+
+static void _windowOrigin(
+  float x,		/* center of window */
+  float y,
+  int width,		/* size of window */
+  int height,
+  _WindowOrigin *o)
+{
+  float xl = x - width/2;
+  float yl = y - height/2;
+  float ax, ay;
+
+  o->xt = (int) xl;
+  o->yt = (int) yl;
+  ax = xl - o->xt;
+  ay = yl - o->yt;
+  o->w[0] = (1-ax) * (1-ay);
+  o->w[1] = ax   * (1-ay);
+  o->w[2] = (1-ax) *   ay;
+  o->w[3] = ax   *   ay;
+}
+
+static const float *_imageRow(
+  _KLT_FloatImage img,
+  int x, int y,		/* first pixel */
+  int n,		/* # of pixels */
+  float *tmp)		/* room to widen them into */
+{
+  const unsigned short *in;
+  int i;
+
+  assert(x >= 0 && y >= 0 && x + n <= img->ncols && y < img->nrows);
+  if (img->storage == KLT_STORE_FLOAT)
+    return img->data + y*img->stride + x;
+
+  in = img->data16 + y*img->stride + x;
+  if (img->storage == KLT_STORE_HALF)
+    for (i = 0 ; i < n ; i++)  tmp[i] = _KLTHalfToFloat(in[i]);
+  else
+    for (i = 0 ; i < n ; i++)  tmp[i] = (short) in[i] * img->scale;
+  return tmp;
+}
+
+static void _interpolateRows(
+  const float *a0,	/* two rows of the first image, n+1 pixels each */
+  const float *a1,
+  const float *wa,	/* and its weights */
+  const float *b0,	/* the same for the second, unless op is */
+  const float *b1,	/*   _SAMPLE_ONE */
+  const float *wb,
+  int n,
+  _SampleOp op,
+  float *out)
+{
+  float a, b;
+  int i = 0;
+
+#ifdef __SSE2__
+  {
+    __m128 wa0 = _mm_set1_ps(wa[0]), wa1 = _mm_set1_ps(wa[1]);
+    __m128 wa2 = _mm_set1_ps(wa[2]), wa3 = _mm_set1_ps(wa[3]);
+    __m128 wb0, wb1, wb2, wb3, va, vb;
+
+    if (op != _SAMPLE_ONE)  {
+      wb0 = _mm_set1_ps(wb[0]);  wb1 = _mm_set1_ps(wb[1]);
+      wb2 = _mm_set1_ps(wb[2]);  wb3 = _mm_set1_ps(wb[3]);
+    } else
+      wb0 = wb1 = wb2 = wb3 = _mm_setzero_ps();
+
+    for ( ; i + 4 <= n ; i += 4)  {
+      va = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+             _mm_mul_ps(wa0, _mm_loadu_ps(a0 + i)),
+             _mm_mul_ps(wa1, _mm_loadu_ps(a0 + i + 1))),
+             _mm_mul_ps(wa2, _mm_loadu_ps(a1 + i))),
+             _mm_mul_ps(wa3, _mm_loadu_ps(a1 + i + 1)));
+      if (op == _SAMPLE_ONE)  {
+        _mm_storeu_ps(out + i, va);
+        continue;
+      }
+      vb = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+             _mm_mul_ps(wb0, _mm_loadu_ps(b0 + i)),
+             _mm_mul_ps(wb1, _mm_loadu_ps(b0 + i + 1))),
+             _mm_mul_ps(wb2, _mm_loadu_ps(b1 + i))),
+             _mm_mul_ps(wb3, _mm_loadu_ps(b1 + i + 1)));
+      _mm_storeu_ps(out + i, (op == _SAMPLE_DIFF) ? _mm_sub_ps(va, vb)
+                                                  : _mm_add_ps(va, vb));
+    }
   }
 #endif
 
-  assert (xt >= 0 && yt >= 0 && xt <= img->ncols - 2 && yt <= img->nrows - 2);
+  /* Remaining pixels, computed the same way */
+  for ( ; i < n ; i++)  {
+    a = wa[0]*a0[i] + wa[1]*a0[i+1] + wa[2]*a1[i] + wa[3]*a1[i+1];
+    if (op == _SAMPLE_ONE)  {
+      out[i] = a;
+      continue;
+    }
+    b = wb[0]*b0[i] + wb[1]*b0[i+1] + wb[2]*b1[i] + wb[3]*b1[i+1];
+    out[i] = (op == _SAMPLE_DIFF) ? a - b : a + b;
+  }
+}
 
-  return ( (1-ax) * (1-ay) * *ptr +
-           ax   * (1-ay) * *(ptr+1) +
-           (1-ax) *   ay   * *(ptr+(img->ncols)) +
-           ax   *   ay   * *(ptr+(img->ncols)+1) );
+static void _sampleRow(
+  _KLT_FloatImage imga,	/* first image and its window */
+  const _WindowOrigin *oa,
+  _KLT_FloatImage imgb,	/* second, or NULL for _SAMPLE_ONE */
+  const _WindowOrigin *ob,
+  int j,		/* row of the window */
+  int width,
+  _SampleOp op,
+  float *rowbuf,
+  float *out)
+{
+  int n = width + 1;
+  const float *a0, *a1, *b0 = NULL, *b1 = NULL;
+
+  a0 = _imageRow(imga, oa->xt, oa->yt + j, n, rowbuf);
+  a1 = _imageRow(imga, oa->xt, oa->yt + j + 1, n, rowbuf + n);
+  if (op != _SAMPLE_ONE)  {
+    b0 = _imageRow(imgb, ob->xt, ob->yt + j, n, rowbuf + 2*n);
+    b1 = _imageRow(imgb, ob->xt, ob->yt + j + 1, n, rowbuf + 3*n);
+  }
+  _interpolateRows(a0, a1, oa->w, b0, b1, (op != _SAMPLE_ONE) ? ob->w : NULL,
+                   width, op, out);
 }
 
 
@@ -72,55 +194,116 @@ static void _computeIntensityDifference(
   float x1, float y1,     /* center of window in 1st img */
   float x2, float y2,     /* center of window in 2nd img */
   int width, int height,  /* size of window */
+  float *rowbuf,
   _FloatWindow imgdiff)   /* output */
 {
-  register int hw = width/2, hh = height/2;
-  float g1, g2;
-  register int i, j;
-
-  /* Compute values */
-  for (j = -hh ; j <= hh ; j++)
-    for (i = -hw ; i <= hw ; i++)  {
-      g1 = _interpolate(x1+i, y1+j, img1);
-      g2 = _interpolate(x2+i, y2+j, img2);
-      *imgdiff++ = g1 - g2;
-    }
+  _WindowOrigin o1, o2;
+  int j;
+
+  _windowOrigin(x1, y1, width, height, &o1);
+  _windowOrigin(x2, y2, width, height, &o2);
+  for (j = 0 ; j < height ; j++)
+    _sampleRow(img1, &o1, img2, &o2, j, width, _SAMPLE_DIFF, rowbuf,
+               imgdiff + j*width);
 }
 
 
 /*********************************************************************
- * _computeGradientSum
+ * _computeWindows
  *
- * Given two gradients and the window center in both images,
- * aligns the gradients wrt the window and computes the sum of the two 
- * overlaid gradients.
+ * Given two images, their gradients and the window center in both
+ * images, computes in one pass the difference between the two
+ * overlaid images and the sums of the two overlaid gradients.
  */
 
-static void _computeGradientSum(
-  _KLT_FloatImage gradx1,  /* gradient images */
+static void _computeWindows(
+  _KLT_FloatImage img1,    /* images and gradients */
+  _KLT_FloatImage gradx1,
   _KLT_FloatImage grady1,
+  _KLT_FloatImage img2,
   _KLT_FloatImage gradx2,
   _KLT_FloatImage grady2,
   float x1, float y1,      /* center of window in 1st img */
   float x2, float y2,      /* center of window in 2nd img */
   int width, int height,   /* size of window */
-  _FloatWindow gradx,      /* output */
+  float *rowbuf,
+  _FloatWindow imgdiff,    /* output */
+  _FloatWindow gradx,      /*   " */
   _FloatWindow grady)      /*   " */
 {
-  register int hw = width/2, hh = height/2;
-  float g1, g2;
-  register int i, j;
+  _WindowOrigin o1, o2;
+  int j;
+
+  _windowOrigin(x1, y1, width, height, &o1);
+  _windowOrigin(x2, y2, width, height, &o2);
+  for (j = 0 ; j < height ; j++)  {
+    _sampleRow(img1, &o1, img2, &o2, j, width, _SAMPLE_DIFF, rowbuf,
+               imgdiff + j*width);
+    _sampleRow(gradx1, &o1, gradx2, &o2, j, width, _SAMPLE_SUM, rowbuf,
+               gradx + j*width);
+    _sampleRow(grady1, &o1, grady2, &o2, j, width, _SAMPLE_SUM, rowbuf,
+               grady + j*width);
+  }
+}
 
-  /* Compute values */
-  for (j = -hh ; j <= hh ; j++)
-    for (i = -hw ; i <= hw ; i++)  {
-      g1 = _interpolate(x1+i, y1+j, gradx1);
-      g2 = _interpolate(x2+i, y2+j, gradx2);
-      *gradx++ = g1 + g2;
-      g1 = _interpolate(x1+i, y1+j, grady1);
-      g2 = _interpolate(x2+i, y2+j, grady2);
-      *grady++ = g1 + g2;
-    }
+
+/*********************************************************************
+ * _computeTemplate
+ *
+ * Samples the window around (x1,y1) in the first image and its
+ * gradients, for the inverse-compositional tracker.
+ */
+
+static void _computeTemplate(
+  _KLT_FloatImage img1,    /* image and its gradients */
+  _KLT_FloatImage gradx1,
+  _KLT_FloatImage grady1,
+  float x1, float y1,      /* center of window */
+  int width, int height,   /* size of window */
+  float *rowbuf,
+  _FloatWindow tmpl,       /* output */
+  _FloatWindow gradx,      /*   " */
+  _FloatWindow grady)      /*   " */
+{
+  _WindowOrigin o1;
+  int j;
+
+  _windowOrigin(x1, y1, width, height, &o1);
+  for (j = 0 ; j < height ; j++)  {
+    _sampleRow(img1, &o1, NULL, NULL, j, width, _SAMPLE_ONE, rowbuf,
+               tmpl + j*width);
+    _sampleRow(gradx1, &o1, NULL, NULL, j, width, _SAMPLE_ONE, rowbuf,
+               gradx + j*width);
+    _sampleRow(grady1, &o1, NULL, NULL, j, width, _SAMPLE_ONE, rowbuf,
+               grady + j*width);
+  }
+}
+
+
+/*********************************************************************
+ * _computeTemplateDifference
+ *
+ * Like _computeIntensityDifference, but takes the first image's window
+ * from a template sampled beforehand.
+ */
+
+static void _computeTemplateDifference(
+  _FloatWindow tmpl,      /* window in 1st img */
+  _KLT_FloatImage img2,
+  float x2, float y2,     /* center of window in 2nd img */
+  int width, int height,  /* size of window */
+  float *rowbuf,
+  _FloatWindow imgdiff)   /* output */
+{
+  _WindowOrigin o2;
+  int i, j;
+
+  _windowOrigin(x2, y2, width, height, &o2);
+  for (j = 0 ; j < height ; j++)
+    _sampleRow(img2, &o2, NULL, NULL, j, width, _SAMPLE_ONE, rowbuf,
+               imgdiff + j*width);
+  for (i = 0 ; i < width*height ; i++)
+    imgdiff[i] = tmpl[i] - imgdiff[i];
 }
 
 
@@ -209,22 +392,6 @@ static int _solveEquation(
 }
 
 
-/*********************************************************************
- * _allocateFloatWindow
- */
-	
-static _FloatWindow _allocateFloatWindow(
-  int width,
-  int height)
-{
-  _FloatWindow fw;
-
-  fw = (_FloatWindow) malloc(width*height*sizeof(float));
-  if (fw == NULL)  KLTError("(_allocateFloatWindow) Out of memory.");
-  return fw;
-}
-
-
 /*********************************************************************
  * _printFloatWindow
  * (for debugging purposes)
@@ -296,9 +463,12 @@ static int _trackFeature(
   int max_iterations,
   float small,         /* determinant threshold for declaring KLT_SMALL_DET */
   float th,            /* displacement threshold for stopping               */
-  float max_residue)   /* residue threshold for declaring KLT_LARGE_RESIDUE */
+  float max_residue,   /* residue threshold for declaring KLT_LARGE_RESIDUE */
+  float *windows,      /* room for _windowScratch(width, height) floats */
+  int *niterations)    /* output:  # of iterations used */
 {
   _FloatWindow imgdiff, gradx, grady;
+  float *rowbuf;
   float gxx, gxy, gyy, ex, ey, dx, dy;
   int iteration = 0;
   int status;
@@ -309,10 +479,11 @@ static int _trackFeature(
   float one_plus_eps = 1.000001f;   /* To prevent rounding errors */
 
 	
-  /* Allocate memory for windows */
-  imgdiff = _allocateFloatWindow(width, height);
-  gradx   = _allocateFloatWindow(width, height);
-  grady   = _allocateFloatWindow(width, height);
+  /* Carve the windows out of the caller's buffer */
+  imgdiff = windows;
+  gradx   = windows + width*height;
+  grady   = windows + 2*width*height;
+  rowbuf  = windows + 4*width*height;
 
   /* Iteratively update the window position */
   do  {
@@ -327,12 +498,9 @@ static int _trackFeature(
     }
 
     /* Compute gradient and difference windows */
-    _computeIntensityDifference(img1, img2, x1, y1, *x2, *y2, 
-                                width, height, imgdiff);
-
-    _computeGradientSum(gradx1, grady1, gradx2, grady2, 
-			x1, y1, *x2, *y2, width, height, gradx, grady);
-		
+    _computeWindows(img1, gradx1, grady1, img2, gradx2, grady2,
+                    x1, y1, *x2, *y2, width, height, rowbuf,
+                    imgdiff, gradx, grady);
 
     /* Use these windows to construct matrices */
     _compute2by2GradientMatrix(gradx, grady, width, height, 
@@ -358,15 +526,13 @@ static int _trackFeature(
   /* Check whether residue is too large */
   if (status == KLT_TRACKED)  {
     _computeIntensityDifference(img1, img2, x1, y1, *x2, *y2, 
-                                width, height, imgdiff);
+                                width, height, rowbuf, imgdiff);
     if (_sumAbsFloatWindow(imgdiff, width, height)/(width*height) > max_residue) 
       status = KLT_LARGE_RESIDUE;
   }
 
-  /* Free memory */
-  free(imgdiff);  free(gradx);  free(grady);
-
   /* Return appropriate value */
+  *niterations = iteration;
   if (status == KLT_SMALL_DET)  return KLT_SMALL_DET;
   else if (status == KLT_OOB)  return KLT_OOB;
   else if (status == KLT_LARGE_RESIDUE)  return KLT_LARGE_RESIDUE;
@@ -376,6 +542,351 @@ static int _trackFeature(
 }
 
 
+/*********************************************************************
+ * _trackFeatureInverse
+ *
+ * Tracks a feature like _trackFeature(), but by the inverse
+ * compositional method:  the window and gradients are taken from the
+ * first image only, so they, and the inverse of the gradient matrix,
+ * are computed once, and each iteration only resamples the second
+ * image.  Takes room for four windows.
+ */
+
+static int _trackFeatureInverse(
+  float x1,  /* location of window in first image */
+  float y1,
+  float *x2, /* starting location of search in second image */
+  float *y2,
+  _KLT_FloatImage img1, 
+  _KLT_FloatImage gradx1,
+  _KLT_FloatImage grady1,
+  _KLT_FloatImage img2, 
+  int width,           /* size of window */
+  int height,
+  int max_iterations,
+  float small,         /* determinant threshold for declaring KLT_SMALL_DET */
+  float th,            /* displacement threshold for stopping               */
+  float max_residue,   /* residue threshold for declaring KLT_LARGE_RESIDUE */
+  float *windows,      /* room for _windowScratch(width, height) floats */
+  int *niterations)    /* output:  # of iterations used */
+{
+  _FloatWindow tmpl, imgdiff, gradx, grady;
+  float *rowbuf;
+  float gxx, gxy, gyy, det, ex, ey, dx, dy;
+  float ixx, ixy, iyy;  /* inverse of the gradient matrix */
+  int iteration = 0;
+  int status = KLT_TRACKED;
+  int hw = width/2;
+  int hh = height/2;
+  int nc = img1->ncols;
+  int nr = img1->nrows;
+  float one_plus_eps = 1.000001f;   /* To prevent rounding errors */
+
+  /* Carve the windows out of the caller's buffer */
+  tmpl    = windows;
+  imgdiff = windows + width*height;
+  gradx   = windows + 2*width*height;
+  grady   = windows + 3*width*height;
+  rowbuf  = windows + 4*width*height;
+
+  *niterations = 0;
+  if ( x1-hw < 0.0f ||  x1+hw > nc-one_plus_eps ||
+       y1-hh < 0.0f ||  y1+hh > nr-one_plus_eps)
+    return KLT_OOB;
+
+  /* Sample the template and invert its gradient matrix, once */
+  _computeTemplate(img1, gradx1, grady1, x1, y1, width, height, rowbuf,
+                   tmpl, gradx, grady);
+  _compute2by2GradientMatrix(gradx, grady, width, height, 
+                             &gxx, &gxy, &gyy);
+  det = gxx*gyy - gxy*gxy;
+
+  /* _trackFeature() sums the gradients of both images, about twice */
+  /* these, so its determinant is about 16 times this one; scale to */
+  /* test against the same min_determinant */
+  if (det * 16.0f < small)  return KLT_SMALL_DET;
+  ixx = gyy/det;  ixy = -gxy/det;  iyy = gxx/det;
+
+  /* Iteratively update the window position */
+  do  {
+
+    /* If out of bounds, exit loop */
+    if (*x2-hw < 0.0f || *x2+hw > nc-one_plus_eps ||
+        *y2-hh < 0.0f || *y2+hh > nr-one_plus_eps) {
+      status = KLT_OOB;
+      break;
+    }
+
+    _computeTemplateDifference(tmpl, img2, *x2, *y2, width, height, rowbuf,
+                               imgdiff);
+    _compute2by1ErrorVector(imgdiff, gradx, grady, width, height,
+                            &ex, &ey);
+
+    /* The update to the template's position, inverted and composed */
+    /* with the current position, moves the window in img2 by +d */
+    dx = ixx*ex + ixy*ey;
+    dy = ixy*ex + iyy*ey;
+    *x2 += dx;
+    *y2 += dy;
+    iteration++;
+
+  }  while ((fabs(dx)>=th || fabs(dy)>=th) && iteration < max_iterations);
+
+  /* Check whether window is out of bounds */
+  if (*x2-hw < 0.0f || *x2+hw > nc-one_plus_eps || 
+      *y2-hh < 0.0f || *y2+hh > nr-one_plus_eps)
+    status = KLT_OOB;
+
+  /* Check whether residue is too large */
+  if (status == KLT_TRACKED)  {
+    _computeTemplateDifference(tmpl, img2, *x2, *y2, width, height, rowbuf,
+                               imgdiff);
+    if (_sumAbsFloatWindow(imgdiff, width, height)/(width*height) > max_residue) 
+      status = KLT_LARGE_RESIDUE;
+  }
+
+  /* Return appropriate value */
+  *niterations = iteration;
+  if (status == KLT_OOB)  return KLT_OOB;
+  else if (status == KLT_LARGE_RESIDUE)  return KLT_LARGE_RESIDUE;
+  else if (iteration >= max_iterations)  return KLT_MAX_ITERATIONS;
+  else  return KLT_TRACKED;
+}
+
+
+/*********************************************************************
+ * _computeImagePyramid
+ *
+ * Smooths an image and builds its pyramid, in floating point or, if
+ * the context asks for it, in fixed point.
+ */
+
+static void _computeImagePyramid(
+  KLT_TrackingContext tc,
+  KLT_Image img,
+  _KLT_Pyramid pyramid)
+{
+  int ncols = img->ncols, nrows = img->nrows;
+
+  if (tc->fixedPoint)  {
+    _KLT_ShortImage fixedimg =
+      _KLTGetScratchShortImage(tc, _KLT_SCRATCH_INPUT_FIXED, ncols, nrows);
+    _KLTToSmoothedFixedImage(tc, img, _KLTComputeSmoothSigma(tc), fixedimg);
+    _KLTComputeFixedPyramid(tc, fixedimg, pyramid, tc->pyramid_sigma_fact);
+  } else  {
+    /* Smooth straight into level 0, so that it need not be copied */
+    _KLT_FloatImage tmpimg =
+      _KLTGetScratchFloatImage(tc, _KLT_SCRATCH_INPUT, ncols, nrows);
+    _KLTToFloatImage(img, tmpimg);
+    _KLTComputeSmoothedImage(tc, tmpimg, _KLTComputeSmoothSigma(tc),
+                             pyramid->img[0]);
+    _KLTComputePyramid(tc, pyramid->img[0], pyramid, tc->pyramid_sigma_fact);
+  }
+}
+
+
+/*********************************************************************
+ * _computeGradientPyramids
+ *
+ * Computes the gradients of levels first onwards of floatpyr.  If the
+ * context stores pyramids in 16 bits, the levels and their gradients
+ * are then packed into pyramid, pyramid_gradx and pyramid_grady;
+ * otherwise floatpyr is pyramid itself.
+ */
+
+static void _computeGradientPyramids(
+  KLT_TrackingContext tc,
+  _KLT_Pyramid floatpyr,
+  _KLT_Pyramid pyramid,
+  _KLT_Pyramid pyramid_gradx,
+  _KLT_Pyramid pyramid_grady,
+  int first)
+{
+  int i;
+
+  for (i = first ; i < pyramid->nLevels ; i++)  {
+    _KLT_FloatImage level = floatpyr->img[i];
+    _KLT_FloatImage gradx, grady;
+
+    if (floatpyr == pyramid)  {
+      _KLTComputeGradients(tc, level, tc->grad_sigma, 
+                           pyramid_gradx->img[i], pyramid_grady->img[i]);
+      continue;
+    }
+
+    gradx = _KLTGetScratchFloatImage(tc, _KLT_SCRATCH_PACK_GRADX,
+                                     level->ncols, level->nrows);
+    grady = _KLTGetScratchFloatImage(tc, _KLT_SCRATCH_PACK_GRADY,
+                                     level->ncols, level->nrows);
+    _KLTComputeGradients(tc, level, tc->grad_sigma, gradx, grady);
+    _KLTPackImage(level, pyramid->img[i]);
+    _KLTPackImage(gradx, pyramid_gradx->img[i]);
+    _KLTPackImage(grady, pyramid_grady->img[i]);
+  }
+}
+
+
+/*********************************************************************
+ * _computePyramids
+ *
+ * Builds nlevels levels of the pyramid of an image and its gradient
+ * pyramids.  If the context stores them in 16 bits, each level is
+ * computed in floating point and then packed, so only the packed
+ * images are kept.
+ */
+
+static void _computePyramids(
+  KLT_TrackingContext tc,
+  KLT_Image img,
+  int nlevels,
+  _KLT_Pyramid *pyramid,
+  _KLT_Pyramid *pyramid_gradx,
+  _KLT_Pyramid *pyramid_grady)
+{
+  int ncols = img->ncols, nrows = img->nrows;
+  int subsampling = tc->subsampling;
+  int storage = tc->pyramidStorage;
+  _KLT_Pyramid floatpyr;
+
+  *pyramid = _KLTGetPyramid(tc, ncols, nrows, subsampling, nlevels, storage);
+  *pyramid_gradx = _KLTGetPyramid(tc, ncols, nrows, subsampling, nlevels,
+                                  storage);
+  *pyramid_grady = _KLTGetPyramid(tc, ncols, nrows, subsampling, nlevels,
+                                  storage);
+
+  if (storage == KLT_STORE_FLOAT)  {
+    _computeImagePyramid(tc, img, *pyramid);
+    _computeGradientPyramids(tc, *pyramid, *pyramid, *pyramid_gradx,
+                             *pyramid_grady, 0);
+    return;
+  }
+
+  floatpyr = _KLTGetPyramid(tc, ncols, nrows, subsampling, nlevels,
+                            KLT_STORE_FLOAT);
+  _computeImagePyramid(tc, img, floatpyr);
+  _computeGradientPyramids(tc, floatpyr, *pyramid, *pyramid_gradx,
+                           *pyramid_grady, 0);
+  _KLTReleasePyramid(tc, floatpyr);
+}
+
+
+/*********************************************************************
+ * _extendPyramids
+ *
+ * Adds levels to pyramids kept from the previous frame, which was
+ * tracked with fewer, building each from the one before as
+ * _KLTComputePyramid would have.  (In fixedPoint mode the levels added
+ * are built in floating point.)
+ */
+
+static void _extendPyramids(
+  KLT_TrackingContext tc,
+  int nlevels,
+  _KLT_Pyramid *pyramid,
+  _KLT_Pyramid *pyramid_gradx,
+  _KLT_Pyramid *pyramid_grady)
+{
+  int first = (*pyramid)->nLevels;
+  int subsampling = (*pyramid)->subsampling;
+  float sigma = subsampling * tc->pyramid_sigma_fact;
+  _KLT_Pyramid floatpyr;
+  int i;
+
+  if (first >= nlevels)  return;
+
+  *pyramid = _KLTGrowPyramid(tc, *pyramid, nlevels);
+  *pyramid_gradx = _KLTGrowPyramid(tc, *pyramid_gradx, nlevels);
+  *pyramid_grady = _KLTGrowPyramid(tc, *pyramid_grady, nlevels);
+
+  if ((*pyramid)->img[0]->storage == KLT_STORE_FLOAT)
+    floatpyr = *pyramid;
+  else  {
+    floatpyr = _KLTGetPyramid(tc, (*pyramid)->ncols[0], (*pyramid)->nrows[0],
+                              subsampling, nlevels, KLT_STORE_FLOAT);
+    _KLTUnpackImage((*pyramid)->img[first-1], floatpyr->img[first-1]);
+  }
+
+  for (i = first ; i < nlevels ; i++)
+    _KLTComputeSmoothedSubsampledImage(tc, floatpyr->img[i-1], sigma,
+                                       subsampling, floatpyr->img[i]);
+  _computeGradientPyramids(tc, floatpyr, *pyramid, *pyramid_gradx,
+                           *pyramid_grady, first);
+
+  if (floatpyr != *pyramid)
+    _KLTReleasePyramid(tc, floatpyr);
+}
+
+
+/*********************************************************************
+ * _pyramidLevelsFor
+ * _updatePyramidDepth
+ *
+ * With adaptivePyramid, the context builds only as many pyramid levels
+ * as it takes for the search to reach ADAPTIVE_MARGIN times the 95th
+ * percentile of the displacements seen in the last frame.  A frame
+ * that needs more levels gets them at once, and so does one that
+ * loses more than ADAPTIVE_MAX_LOSS of its features, which is taken
+ * to mean the motion outran the pyramid:  it goes straight to the
+ * full nPyramidLevels.  Levels are dropped one at a time, and only
+ * after pyramid_hold_frames frames in a row that needed fewer.
+ */
+
+#define ADAPTIVE_MARGIN    1.5f
+#define ADAPTIVE_MAX_LOSS  0.25f
+
+static int _pyramidLevelsFor(
+  KLT_TrackingContext tc,
+  float displacement)
+{
+  float step = min(tc->window_width, tc->window_height) / 2;
+  float range = step;	/* reach of the search with n levels */
+  int n = 1;
+
+  while (n < tc->nPyramidLevels && range < ADAPTIVE_MARGIN * displacement)  {
+    step *= tc->subsampling;
+    range += step;
+    n++;
+  }
+  return n;
+}
+
+static int _compareFloats(
+  const void *a,
+  const void *b)
+{
+  float fa = *(const float *) a, fb = *(const float *) b;
+
+  return (fa > fb) - (fa < fb);
+}
+
+static void _updatePyramidDepth(
+  KLT_TrackingContext tc,
+  float *displacement,	/* of each feature tracked; sorted in place */
+  int ntracked,
+  int nattempted)
+{
+  int needed;
+
+  if (nattempted == 0)  return;
+
+  if (nattempted - ntracked > ADAPTIVE_MAX_LOSS * nattempted)
+    needed = tc->nPyramidLevels;
+  else  {
+    qsort(displacement, ntracked, sizeof(float), _compareFloats);
+    needed = _pyramidLevelsFor(tc,
+               (ntracked > 0) ? displacement[(int) (0.95f * (ntracked-1))] : 0);
+  }
+
+  if (needed >= tc->pyramid_levels)  {
+    tc->pyramid_levels = needed;
+    tc->pyramid_calm_frames = 0;
+  } else if (++tc->pyramid_calm_frames >= tc->pyramid_hold_frames)  {
+    tc->pyramid_levels--;
+    tc->pyramid_calm_frames = 0;
+  }
+}
+
+
 /*********************************************************************/
 
 static KLT_BOOL _outOfBounds(
@@ -392,36 +903,267 @@ static KLT_BOOL _outOfBounds(
 
 
 /*********************************************************************
- * KLTTrackFeatures
+ * _TrackState
  *
- * Tracks feature points from one image to the next.
+ * Where each feature being tracked has got to, kept as parallel arrays
+ * while all features are tracked through one pyramid level at a time.
  */
 
-void KLTTrackFeatures(
+typedef struct  {
+  int *indx;		/* feature in the list */
+  float *xloc, *yloc;	/* location in the first image, at current level */
+  float *xlocout, *ylocout;	/* and in the second */
+  int *val;		/* result of the last level tracked */
+  int *niter;		/* iterations used, over all levels */
+}  _TrackState;
+
+static _TrackState _getTrackState(
   KLT_TrackingContext tc,
-  KLT_PixelType *img1,
-  KLT_PixelType *img2,
-  int ncols,
-  int nrows,
-  KLT_FeatureList featurelist)
+  int nFeatures)
+{
+  _TrackState state;
+  float *f;
+
+  f = (float *) _KLTGetScratch(tc, _KLT_SCRATCH_TRACK_STATE,
+               nFeatures * (4*sizeof(float) + 3*sizeof(int)));
+  state.xloc    = f;
+  state.yloc    = f + nFeatures;
+  state.xlocout = f + 2*nFeatures;
+  state.ylocout = f + 3*nFeatures;
+  state.indx    = (int *) (f + 4*nFeatures);
+  state.val     = state.indx + nFeatures;
+  state.niter   = state.indx + 2*nFeatures;
+  return state;
+}
+
+/* Sets entry i up to track feature indx of fs from the coarsest of */
+/* nlevels levels, starting at its prediction if it has one */
+static void _startTrack(
+  _TrackState *s,
+  int i,
+  KLT_FeatureStore fs,
+  KLT_FeatureStore predicted,
+  int indx,
+  int nlevels,
+  float subsampling)
+{
+  float xloc = fs->x[indx];
+  float yloc = fs->y[indx];
+  float xlocout = xloc, ylocout = yloc;
+  int r;
+
+  if (predicted != NULL && predicted->val[indx] >= 0)  {
+    xlocout = predicted->x[indx];
+    ylocout = predicted->y[indx];
+  }
+  for (r = nlevels - 1 ; r >= 0 ; r--)  {
+    xloc /= subsampling;  yloc /= subsampling;
+    xlocout /= subsampling;  ylocout /= subsampling;
+  }
+  s->indx[i] = indx;
+  s->xloc[i] = xloc;
+  s->yloc[i] = yloc;
+  s->xlocout[i] = xlocout;
+  s->ylocout[i] = ylocout;
+}
+
+/* The state of entries first onwards */
+static _TrackState _offsetTrackState(
+  _TrackState *s,
+  int first)
+{
+  _TrackState t;
+
+  t.indx = s->indx + first;
+  t.xloc = s->xloc + first;
+  t.yloc = s->yloc + first;
+  t.xlocout = s->xlocout + first;
+  t.ylocout = s->ylocout + first;
+  t.val = s->val + first;
+  t.niter = s->niter + first;
+  return t;
+}
+
+static void _swapTrackState(
+  _TrackState *s,
+  int i,
+  int j)
+{
+  float f;
+  int n;
+
+  n = s->indx[i];  s->indx[i] = s->indx[j];  s->indx[j] = n;
+  n = s->val[i];  s->val[i] = s->val[j];  s->val[j] = n;
+  n = s->niter[i];  s->niter[i] = s->niter[j];  s->niter[j] = n;
+  f = s->xloc[i];  s->xloc[i] = s->xloc[j];  s->xloc[j] = f;
+  f = s->yloc[i];  s->yloc[i] = s->yloc[j];  s->yloc[j] = f;
+  f = s->xlocout[i];  s->xlocout[i] = s->xlocout[j];  s->xlocout[j] = f;
+  f = s->ylocout[i];  s->ylocout[i] = s->ylocout[j];  s->ylocout[j] = f;
+}
+
+
+/*********************************************************************
+ * _trackFeatures
+ *
+ * Tracks a contiguous share of the live features through one pyramid
+ * level.  Tasks write disjoint entries of the state, so the results do
+ * not depend on how they are spread over threads.
+ */
+
+typedef struct  {
+  KLT_TrackingContext tc;
+  _TrackState *state;
+  int nlive;			/* # of features to track */
+  int ntasks;
+  int maxtasks;
+  _KLT_FloatImage img1, gradx1, grady1;	/* current level */
+  _KLT_FloatImage img2, gradx2, grady2;
+  float *windows;		/* ntasks times windowsize floats */
+  int windowsize;
+}  _TrackJob;
+
+static void _trackFeatures(
+  void *arg,
+  int index)
+{
+  _TrackJob *job = (_TrackJob *) arg;
+  KLT_TrackingContext tc = job->tc;
+  _TrackState *s = job->state;
+  float subsampling = tc->subsampling;
+  float *windows = job->windows + index * job->windowsize;
+  int lo = (int) ((long) job->nlive * index / job->ntasks);
+  int hi = (int) ((long) job->nlive * (index + 1) / job->ntasks);
+  int i, n;
+
+  for (i = lo ; i < hi ; i++)  {
+    s->xloc[i] *= subsampling;  s->yloc[i] *= subsampling;
+    s->xlocout[i] *= subsampling;  s->ylocout[i] *= subsampling;
+
+    if (tc->inverseCompositional)
+      s->val[i] = _trackFeatureInverse(s->xloc[i], s->yloc[i], 
+                                       &s->xlocout[i], &s->ylocout[i],
+                                       job->img1, job->gradx1, job->grady1,
+                                       job->img2, 
+                                       tc->window_width, tc->window_height,
+                                       tc->max_iterations,
+                                       tc->min_determinant,
+                                       tc->min_displacement,
+                                       tc->max_residue,
+                                       windows, &n);
+    else
+      s->val[i] = _trackFeature(s->xloc[i], s->yloc[i], 
+                                &s->xlocout[i], &s->ylocout[i],
+                                job->img1, job->gradx1, job->grady1,
+                                job->img2, job->gradx2, job->grady2,
+                                tc->window_width, tc->window_height,
+                                tc->max_iterations,
+                                tc->min_determinant,
+                                tc->min_displacement,
+                                tc->max_residue,
+                                windows, &n);
+    s->niter[i] += n;
+  }
+}
+
+
+/*********************************************************************
+ * _trackLevels
+ *
+ * Beginning with coarsest resolution, tracks every feature at one
+ * level before moving to the next, so that each level's images stay
+ * in cache.  Features that fail for good are moved to the end of the
+ * state's arrays and not tracked further.
+ */
+
+static void _trackLevels(
+  _TrackJob *job,
+  _TrackState *state,
+  int nlive,		/* # of features in state */
+  int nlevels,
+  _KLT_Pyramid pyramid1,
+  _KLT_Pyramid pyramid1_gradx,
+  _KLT_Pyramid pyramid1_grady,
+  _KLT_Pyramid pyramid2,
+  _KLT_Pyramid pyramid2_gradx,
+  _KLT_Pyramid pyramid2_grady)
+{
+  int r, i;
+
+  job->state = state;
+  for (r = nlevels - 1 ; r >= 0 ; r--)  {
+    job->img1  = pyramid1->img[r];
+    job->gradx1 = pyramid1_gradx->img[r];
+    job->grady1 = pyramid1_grady->img[r];
+    job->img2  = pyramid2->img[r];
+    job->gradx2 = pyramid2_gradx->img[r];
+    job->grady2 = pyramid2_grady->img[r];
+    job->nlive = nlive;
+    job->ntasks = (nlive < job->maxtasks) ? nlive : job->maxtasks;
+    _KLTRunTasks(job->tc, job->ntasks, _trackFeatures, job);
+
+    for (i = 0 ; i < nlive ; )
+      if (state->val[i]==KLT_SMALL_DET || state->val[i]==KLT_OOB)
+        _swapTrackState(state, i, --nlive);
+      else
+        i++;
+  }
+}
+
+
+/*********************************************************************
+ * KLTTrackFeatureStoreImage
+ *
+ * Tracks feature points from one image to the next, starting the
+ * search for each feature in the second image at the position given
+ * by the corresponding entry of 'predicted' (a store of the same size),
+ * or at the feature's own position where that entry's val is negative
+ * or 'predicted' is NULL.  A good prediction, e.g. from the feature's
+ * velocity or from the camera's motion, saves iterations and keeps
+ * features that move further than the pyramid can follow.
+ *
+ * The number of features tracked and lost, and the iterations used,
+ * are left in tc->nTrackAttempted, tc->nTrackLost and
+ * tc->nTrackIterations.  If fs keeps motion, each feature tracked
+ * has its displacement stored and its age incremented, and each lost
+ * has them reset.
+ *
+ * The images are described by KLT_ImageRecs, so they may be strided.
+ * In sequentialMode, once a frame has been tracked, img1 is not read
+ * (the last frame's pyramids are used instead) and may be NULL.
+ */
+
+void KLTTrackFeatureStoreImage(
+  KLT_TrackingContext tc,
+  KLT_Image img1,
+  KLT_Image img2,
+  KLT_FeatureStore fs,
+  KLT_FeatureStore predicted)
 {
-  _KLT_FloatImage tmpimg, floatimg1, floatimg2;
+  int ncols = img2->ncols, nrows = img2->nrows;
   _KLT_Pyramid pyramid1, pyramid1_gradx, pyramid1_grady,
     pyramid2, pyramid2_gradx, pyramid2_grady;
   float subsampling = tc->subsampling;
-  float xloc, yloc, xlocout, ylocout;
+  _TrackState state, retry;
+  _TrackJob job;
   int val;
-  int indx, r;
+  int indx;
+  int nlive, ntracked, nlost;
+  int nlevels;
+  float *displacement, x0, y0;
+  int ndisplaced;
   int i;
 
-  floatimg1 = NULL;
-
-  if (KLT_verbose >= 1)  {
+  if (tc->verbosity >= 1)  {
     fprintf(stderr,  "(KLT) Tracking %d features in a %d by %d image...  ",
-            KLTCountRemainingFeatures(featurelist), ncols, nrows);
+            KLTCountRemainingFeatureStore(fs), ncols, nrows);
     fflush(stderr);
   }
 
+  if (predicted != NULL && predicted->nFeatures != fs->nFeatures)
+    KLTError("(KLTTrackFeatureStore) Store of predictions has %d "
+             "features, but the store to track has %d",
+             predicted->nFeatures, fs->nFeatures);
+
   /* Check window size (and correct if necessary) */
   if (tc->window_width % 2 != 1) {
     tc->window_width = tc->window_width+1;
@@ -444,8 +1186,13 @@ void KLTTrackFeatures(
                "Changing to %d.\n", tc->window_height);
   }
 
-  /* Create temporary image */
-  tmpimg = _KLTCreateFloatImage(ncols, nrows);
+  /* Decide how many pyramid levels this frame needs */
+  nlevels = tc->nPyramidLevels;
+  if (tc->adaptivePyramid)  {
+    if (tc->pyramid_levels < 1 || tc->pyramid_levels > nlevels)
+      tc->pyramid_levels = nlevels;
+    nlevels = tc->pyramid_levels;
+  }
 
   /* Process first image by converting to float, smoothing, computing */
   /* pyramid, and computing gradient pyramids */
@@ -459,37 +1206,25 @@ void KLTTrackFeatures(
                ncols, nrows, pyramid1->ncols[0], pyramid1->nrows[0]);
     assert(pyramid1_gradx != NULL);
     assert(pyramid1_grady != NULL);
+    _extendPyramids(tc, nlevels,
+                    &pyramid1, &pyramid1_gradx, &pyramid1_grady);
   } else  {
-    floatimg1 = _KLTCreateFloatImage(ncols, nrows);
-    _KLTToFloatImage(img1, ncols, nrows, tmpimg);
-    _KLTComputeSmoothedImage(tmpimg, _KLTComputeSmoothSigma(tc), floatimg1);
-    pyramid1 = _KLTCreatePyramid(ncols, nrows, subsampling, tc->nPyramidLevels);
-    _KLTComputePyramid(floatimg1, pyramid1, tc->pyramid_sigma_fact);
-    pyramid1_gradx = _KLTCreatePyramid(ncols, nrows, subsampling, tc->nPyramidLevels);
-    pyramid1_grady = _KLTCreatePyramid(ncols, nrows, subsampling, tc->nPyramidLevels);
-    for (i = 0 ; i < tc->nPyramidLevels ; i++)
-      _KLTComputeGradients(pyramid1->img[i], tc->grad_sigma, 
-                           pyramid1_gradx->img[i],
-                           pyramid1_grady->img[i]);
+    if (img1 == NULL || img1->ncols != ncols || img1->nrows != nrows)
+      KLTError("(KLTTrackFeatures) First image is missing, or its size "
+               "is different from that of the second (%d by %d)",
+               ncols, nrows);
+    _computePyramids(tc, img1, nlevels,
+                     &pyramid1, &pyramid1_gradx, &pyramid1_grady);
   }
 
   /* Do the same thing with second image */
-  floatimg2 = _KLTCreateFloatImage(ncols, nrows);
-  _KLTToFloatImage(img2, ncols, nrows, tmpimg);
-  _KLTComputeSmoothedImage(tmpimg, _KLTComputeSmoothSigma(tc), floatimg2);
-  pyramid2 = _KLTCreatePyramid(ncols, nrows, subsampling, tc->nPyramidLevels);
-  _KLTComputePyramid(floatimg2, pyramid2, tc->pyramid_sigma_fact);
-  pyramid2_gradx = _KLTCreatePyramid(ncols, nrows, subsampling, tc->nPyramidLevels);
-  pyramid2_grady = _KLTCreatePyramid(ncols, nrows, subsampling, tc->nPyramidLevels);
-  for (i = 0 ; i < tc->nPyramidLevels ; i++)
-    _KLTComputeGradients(pyramid2->img[i], tc->grad_sigma, 
-                         pyramid2_gradx->img[i],
-                         pyramid2_grady->img[i]);
+  _computePyramids(tc, img2, nlevels,
+                   &pyramid2, &pyramid2_gradx, &pyramid2_grady);
 
   /* Write internal images */
   if (tc->writeInternalImages)  {
     char fname[80];
-    for (i = 0 ; i < tc->nPyramidLevels ; i++)  {
+    for (i = 0 ; i < nlevels ; i++)  {
       sprintf(fname, "kltimg_tf_i%d.pgm", i);
       _KLTWriteFloatImageToPGM(pyramid1->img[i], fname);
       sprintf(fname, "kltimg_tf_i%d_gx.pgm", i);
@@ -505,96 +1240,140 @@ void KLTTrackFeatures(
     }
   }
 
-  /* For each feature, do ... */
-  for (indx = 0 ; indx < featurelist->nFeatures ; indx++)  {
-
-    /* Only track features that are not lost */
-    if (featurelist->feature[indx]->val >= 0)  {
+  /* Gather the features that are not lost */
+  state = _getTrackState(tc, fs->nFeatures);
+  ntracked = 0;
+  for (indx = 0 ; indx < fs->nFeatures ; indx++)
+    if (fs->val[indx] >= 0)  {
+      _startTrack(&state, ntracked, fs, predicted, indx,
+                  nlevels, subsampling);
+      state.niter[ntracked++] = 0;
+    }
 
-      xloc = featurelist->feature[indx]->x;
-      yloc = featurelist->feature[indx]->y;
+  assert(nlevels >= 1);
+
+  /* Split the features into a few tasks per thread, each with its */
+  /* own windows (rounded up to a cache line) */
+  job.tc = tc;
+  job.maxtasks = (tc->nThreads > 1) ? 4 * tc->nThreads : 1;
+  job.windowsize = (_windowScratch(tc->window_width, tc->window_height)
+                    + 15) & ~15;
+  job.windows = (float *) _KLTGetScratch(tc, _KLT_SCRATCH_WINDOWS,
+                  job.maxtasks * job.windowsize * sizeof(float));
+
+  _trackLevels(&job, &state, ntracked, nlevels,
+               pyramid1, pyramid1_gradx, pyramid1_grady,
+               pyramid2, pyramid2_gradx, pyramid2_grady);
+
+  /* With adaptivePyramid, if too many features were lost for the */
+  /* levels used, add the rest of the levels and track the lost ones */
+  /* again from the start */
+  if (tc->adaptivePyramid && nlevels < tc->nPyramidLevels)  {
+    nlost = 0;
+    for (i = 0 ; i < ntracked ; i++)
+      if (state.val[i] != KLT_TRACKED)  nlost++;
+
+    if (nlost > ADAPTIVE_MAX_LOSS * ntracked)  {
+      nlevels = tc->nPyramidLevels;
+      _extendPyramids(tc, nlevels,
+                      &pyramid1, &pyramid1_gradx, &pyramid1_grady);
+      _extendPyramids(tc, nlevels,
+                      &pyramid2, &pyramid2_gradx, &pyramid2_grady);
+      tc->pyramid_levels = nlevels;
+      tc->pyramid_calm_frames = 0;
+
+      /* Move the lost features to the end and start them afresh */
+      nlive = ntracked;
+      for (i = 0 ; i < nlive ; )
+        if (state.val[i] != KLT_TRACKED)
+          _swapTrackState(&state, i, --nlive);
+        else
+          i++;
+      retry = _offsetTrackState(&state, nlive);
+      for (i = 0 ; i < ntracked - nlive ; i++)
+        _startTrack(&retry, i, fs, predicted, retry.indx[i],
+                    nlevels, subsampling);
+      _trackLevels(&job, &retry, ntracked - nlive, nlevels,
+                   pyramid1, pyramid1_gradx, pyramid1_grady,
+                   pyramid2, pyramid2_gradx, pyramid2_grady);
+    }
+  }
 
-      /* Transform location to coarsest resolution */
-      for (r = tc->nPyramidLevels - 1 ; r >= 0 ; r--)  {
-        xloc /= subsampling;  yloc /= subsampling;
+  /* Record features */
+  tc->nTrackAttempted = ntracked;
+  tc->nTrackLost = 0;
+  tc->nTrackIterations = 0;
+  tc->nTrackLevels = nlevels;
+  displacement = NULL;
+  if (tc->adaptivePyramid)
+    displacement = (float *) _KLTGetScratch(tc, _KLT_SCRATCH_MOTION,
+                                            ntracked * sizeof(float));
+  ndisplaced = 0;
+  for (i = 0 ; i < ntracked ; i++)  {
+    indx = state.indx[i];
+
+    /* How far the search had to go, from where it started */
+    if (displacement != NULL && state.val[i] >= 0)  {
+      if (predicted != NULL && predicted->val[indx] >= 0)  {
+        x0 = predicted->x[indx];
+        y0 = predicted->y[indx];
+      } else  {
+        x0 = fs->x[indx];
+        y0 = fs->y[indx];
       }
-      xlocout = xloc;  ylocout = yloc;
-
-      assert(tc->nPyramidLevels >= 1);
-
-      /* Beginning with coarsest resolution, do ... */
-      for (r = tc->nPyramidLevels - 1 ; r >= 0 ; r--)  {
-
-        /* Track feature at current resolution */
-        xloc *= subsampling;  yloc *= subsampling;
-        xlocout *= subsampling;  ylocout *= subsampling;
-
-        val = _trackFeature(xloc, yloc, 
-                            &xlocout, &ylocout,
-                            pyramid1->img[r], 
-                            pyramid1_gradx->img[r], pyramid1_grady->img[r], 
-                            pyramid2->img[r], 
-                            pyramid2_gradx->img[r], pyramid2_grady->img[r],
-                            tc->window_width, tc->window_height,
-                            tc->max_iterations,
-                            tc->min_determinant,
-                            tc->min_displacement,
-                            tc->max_residue);
-	
-        if (val==KLT_SMALL_DET || val==KLT_OOB)
-          break;
+      displacement[ndisplaced++] = max(fabs(state.xlocout[i] - x0),
+                                       fabs(state.ylocout[i] - y0));
+    }
+
+    tc->nTrackIterations += state.niter[i];
+    val = state.val[i];
+    if (val != KLT_OOB && _outOfBounds(state.xlocout[i], state.ylocout[i],
+                                       ncols, nrows, tc->borderx, tc->bordery))
+      val = KLT_OOB;
+
+    if (val == KLT_TRACKED)  {
+      if (fs->age != NULL)  {
+        fs->vx[indx] = state.xlocout[i] - fs->x[indx];
+        fs->vy[indx] = state.ylocout[i] - fs->y[indx];
+        fs->age[indx]++;
       }
-	
-      /* Record feature */
-      if (val == KLT_OOB)  {
-        featurelist->feature[indx]->x   = -1.0;
-        featurelist->feature[indx]->y   = -1.0;
-        featurelist->feature[indx]->val = KLT_OOB;
-      } else if (_outOfBounds(xlocout, ylocout, ncols, nrows, tc->borderx, tc->bordery))  {
-        featurelist->feature[indx]->x   = -1.0;
-        featurelist->feature[indx]->y   = -1.0;
-        featurelist->feature[indx]->val = KLT_OOB;
-      } else if (val == KLT_SMALL_DET)  {
-        featurelist->feature[indx]->x   = -1.0;
-        featurelist->feature[indx]->y   = -1.0;
-        featurelist->feature[indx]->val = KLT_SMALL_DET;
-      } else if (val == KLT_LARGE_RESIDUE)  {
-        featurelist->feature[indx]->x   = -1.0;
-        featurelist->feature[indx]->y   = -1.0;
-        featurelist->feature[indx]->val = KLT_LARGE_RESIDUE;
-      } else if (val == KLT_MAX_ITERATIONS)  {
-        featurelist->feature[indx]->x   = -1.0;
-        featurelist->feature[indx]->y   = -1.0;
-        featurelist->feature[indx]->val = KLT_MAX_ITERATIONS;
-      } else  {
-        featurelist->feature[indx]->x = xlocout;
-        featurelist->feature[indx]->y = ylocout;
-        featurelist->feature[indx]->val = KLT_TRACKED;
+      fs->x[indx] = state.xlocout[i];
+      fs->y[indx] = state.ylocout[i];
+    } else  {
+      if (fs->age != NULL)  {
+        fs->vx[indx] = fs->vy[indx] = 0.0;
+        fs->age[indx] = 0;
       }
+      fs->x[indx] = -1.0;
+      fs->y[indx] = -1.0;
+      tc->nTrackLost++;
     }
+    fs->val[indx] = val;
   }
 
+  if (tc->adaptivePyramid)
+    _updatePyramidDepth(tc, displacement, ndisplaced, ntracked);
+
   if (tc->sequentialMode)  {
     tc->pyramid_last = pyramid2;
     tc->pyramid_last_gradx = pyramid2_gradx;
     tc->pyramid_last_grady = pyramid2_grady;
   } else  {
-    _KLTFreePyramid(pyramid2);
-    _KLTFreePyramid(pyramid2_gradx);
-    _KLTFreePyramid(pyramid2_grady);
-  }
-
-  /* Free memory */
-  _KLTFreeFloatImage(tmpimg);
-  if (floatimg1 != NULL)  _KLTFreeFloatImage(floatimg1);
-  _KLTFreeFloatImage(floatimg2);
-  _KLTFreePyramid(pyramid1);
-  _KLTFreePyramid(pyramid1_gradx);
-  _KLTFreePyramid(pyramid1_grady);
-
-  if (KLT_verbose >= 1)  {
-    fprintf(stderr,  "\n\t%d features successfully tracked.\n",
-            KLTCountRemainingFeatures(featurelist));
+    _KLTReleasePyramid(tc, pyramid2);
+    _KLTReleasePyramid(tc, pyramid2_gradx);
+    _KLTReleasePyramid(tc, pyramid2_grady);
+  }
+
+  /* Keep the first image's pyramids for the next frame to reuse */
+  _KLTReleasePyramid(tc, pyramid1);
+  _KLTReleasePyramid(tc, pyramid1_gradx);
+  _KLTReleasePyramid(tc, pyramid1_grady);
+
+  if (tc->verbosity >= 1)  {
+    fprintf(stderr,  "\n\t%d features successfully tracked, "
+            "%d lost, in %d iterations.\n",
+            KLTCountRemainingFeatureStore(fs), tc->nTrackLost,
+            tc->nTrackIterations);
     if (tc->writeInternalImages)
       fprintf(stderr,  "\tWrote images to 'kltimg_tf*.pgm'.\n");
     fflush(stderr);
@@ -603,3 +1382,68 @@ void KLTTrackFeatures(
 }
 
 
+/*********************************************************************
+ * KLTTrackFeatureStore
+ *
+ * The same, for ncols by nrows pixels packed one after another.
+ */
+
+void KLTTrackFeatureStore(
+  KLT_TrackingContext tc,
+  KLT_PixelType *img1,
+  KLT_PixelType *img2,
+  int ncols,
+  int nrows,
+  KLT_FeatureStore fs,
+  KLT_FeatureStore predicted)
+{
+  KLT_ImageRec image1, image2;
+
+  _KLTPackedImage(img1, ncols, nrows, &image1);
+  _KLTPackedImage(img2, ncols, nrows, &image2);
+  KLTTrackFeatureStoreImage(tc, &image1, &image2, fs, predicted);
+}
+
+
+/*********************************************************************
+ * KLTTrackFeaturesPredicted
+ * KLTTrackFeatures
+ *
+ * The same, for feature lists, which are copied into stores for the
+ * duration.
+ */
+
+void KLTTrackFeaturesPredicted(
+  KLT_TrackingContext tc,
+  KLT_PixelType *img1,
+  KLT_PixelType *img2,
+  int ncols,
+  int nrows,
+  KLT_FeatureList featurelist,
+  KLT_FeatureList predicted)
+{
+  KLT_FeatureStore fs, pred = NULL;
+
+  fs = _KLTGetScratchFeatureStore(tc, _KLT_SCRATCH_FEATURES,
+                                  featurelist->nFeatures);
+  KLTCopyFeatureListToStore(featurelist, fs);
+  if (predicted != NULL)  {
+    pred = _KLTGetScratchFeatureStore(tc, _KLT_SCRATCH_PREDICTED,
+                                      predicted->nFeatures);
+    KLTCopyFeatureListToStore(predicted, pred);
+  }
+
+  KLTTrackFeatureStore(tc, img1, img2, ncols, nrows, fs, pred);
+  KLTCopyFeatureStoreToList(fs, featurelist);
+}
+
+void KLTTrackFeatures(
+  KLT_TrackingContext tc,
+  KLT_PixelType *img1,
+  KLT_PixelType *img2,
+  int ncols,
+  int nrows,
+  KLT_FeatureList featurelist)
+{
+  KLTTrackFeaturesPredicted(tc, img1, img2, ncols, nrows, featurelist, NULL);
+}
@@ -25,9 +25,9 @@ typedef enum {FEATURE_LIST, FEATURE_HISTORY, FEATURE_TABLE} structureType;
 
 static char warning_line[] = "!!! Warning:  This is a KLT data file.  "
                              "Do not modify below this line !!!\n";
-static char binheader_fl[BINHEADERLENGTH+1] = "KLTFL1";
-static char binheader_fh[BINHEADERLENGTH+1] = "KLTFH1";
-static char binheader_ft[BINHEADERLENGTH+1] = "KLTFT1";
+static const char binheader_fl[BINHEADERLENGTH+1] = "KLTFL1";
+static const char binheader_fh[BINHEADERLENGTH+1] = "KLTFH1";
+static const char binheader_ft[BINHEADERLENGTH+1] = "KLTFT1";
 
 /*********************************************************************
  * KLTWriteFeatureListToPPM